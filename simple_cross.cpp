@@ -20,6 +20,11 @@ Inputs:
     O - place order, requires OID, SYMBOL, SIDE, QTY, PX
     X - cancel order, requires OID
     P - print sorted book (see example below)
+    S - print engine statistics, one "S NAME VALUE" result per counter
+    Q - queue position of a resting order, requires OID
+    M - mass quote, see below
+    B - bulk order entry, see below
+    H - book hash, of SYMBOL if given (H [SYMBOL]) or of all symbols
 
     OID: positive 32-bit integer value which must be unique for all orders
 
@@ -31,7 +36,23 @@ Inputs:
 
     QTY: positive 16-bit integer value
 
-    PX: positive double precision value (7.5 format)
+    PX: positive double precision value (7.5 format). A price off the 0.00001 grid or of 10000000 or more is
+        rejected as an invalid price, so the journal, L3 feed and book hash all see exactly the price the book holds
+
+    M PID SYMBOL BID_OID BID_QTY BID_PX ASK_OID ASK_QTY ASK_PX
+
+    Replaces market maker PID's two sided quote in SYMBOL as one action. PID is a positive 32-bit integer, and a maker
+    has at most one bid and one ask per symbol. A side with QTY 0 pulls that side (its OID and PX are ignored), and a
+    two sided quote must have BID_PX below ASK_PX. A side still resting at the same price is updated in place, taking
+    the new OID and QTY: a smaller QTY keeps its time priority, a larger one goes to the back of the level. Other sides
+    are cancelled and the new ones placed, bid first, which may cross and fill like O. The quote is checked as a whole
+    before anything changes, so a rejected quote leaves the previous one standing. It is rejected as E BID_OID, or as
+    E ASK_OID when only the ask's OID is already in use. Results are the F lines of any crosses.
+
+    B OID SYMBOL SIDE QTY PX [OID SYMBOL SIDE QTY PX]...
+
+    Places any number of orders, in any symbols, from one line. Each order is handled exactly as its own O action would
+    be, in line order, and one failing (E OID) does not stop the rest. The results of all of them are returned together.
 
 Outputs:
     A list of strings of space separated values that show the result of the
@@ -45,6 +66,11 @@ Outputs:
     X - cancel confirmation, requires OID
     P - book entry, requires OID, SYMBOL, SIDE, OPEN_QTY, ORD_PX (see example below)
     E - error, requires OID. Remainder of line represents string value description of the error
+    S - statistic, followed by NAME VALUE instead of the fields above
+    Q - queue position, requires OID, SYMBOL, SIDE, OPEN_QTY, ORD_PX followed by ORDERS_AHEAD QTY_AHEAD: the
+        number of orders and the open quantity queued in front of the order at its price level
+    H - book hash, "H [SYMBOL] HASH" with HASH as 16 hex digits. Two books hash equal when they hold the same orders
+        in the same time priority; an empty book hashes to 0
 
     FILL_QTY: positive 16-bit integer value representing qty of the order filled by
               this crossing event
@@ -57,6 +83,21 @@ Outputs:
     ORD_PX:   positive double precision value representing original price of the order (7.5 format)
               (7.5 format means up to 7 digits before the decimal and exactly 5 digits after the decimal)
 
+    With --stamps every result line is followed by SEQ NS ACTION_SEQ ACTION_NS: the engine sequence number and
+    nanosecond wall clock time of the event, and of the inbound action that produced it.
+
+    With --replicate SOCKET the engine streams its actions to a hot standby started on the same machine with
+    --standby SOCKET, which applies them as they arrive, checks its books against periodic checkpoints and takes
+    over, reading its own ACTIONS_FILE, when the primary exits.
+
+    With --journal FILE the engine appends every action that changes the books to FILE in a compact binary format,
+    which --recover FILE replays on the next start. The journal is written in 64KB blocks (group commit), so the
+    actions of the last block not yet written are lost if the process dies, even if their results were printed.
+
+    With --image FILE the engine keeps its books in a memory mapped file, updated as they change. Restarted with the
+    same FILE it re-attaches to those books, rolling back an action a crash left half written, and replays only the
+    --recover journal records after the last action the image holds.
+
 Conditions/Assumptions:
     * The implementation should be a standalone Linux console application (include
       source files, testing tools and Makefile in submission)
@@ -137,6 +178,48 @@ F 10008 IBM 3 102.00000
 #include <queue>
 #include <map>
 #include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <bit>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstdlib>
+#include <array>
+#include <optional>
+#include <charconv>
+#include <limits>
+#include <cctype>
+#include <csignal>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -163,6 +246,218 @@ void log(std::vector<T> ts) {
   std::cout << "----------" << std::endl;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// NUMA
+//
+// Placement helpers for multi socket hosts, straight on top of sysfs and the mbind syscall. A thread pinned to a node's
+// CPUs that binds its arena to the same node keeps its books in local memory; everything else it allocates lands there
+// by first touch. On single node hosts, or without permission, every call degrades to a no-op that returns false.
+//----------------------------------------------------------------------------------------------------------------------
+struct Numa {
+  // From <numaif.h>, which needs the libnuma headers
+  static constexpr int MPOL_BIND_POLICY = 2;
+  static constexpr unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+
+  // Nodes listed as online, at least one
+  static int nodes() {
+    std::vector<int> online = _readList("/sys/devices/system/node/online");
+    return online.empty() ? 1 : online.back() + 1;
+  }
+
+  // Restrict the calling thread to the CPUs of `node`
+  static bool pinThread(int node) {
+    std::vector<int> cpus = _readList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (cpus.empty()) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+
+  // Bind the pages of [p, p + bytes) to `node`, p page aligned. Pages this process already faulted in are moved
+  static bool bind(void* p, size_t bytes, int node) {
+    if (node < 0 || node >= 64) return false;
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, p, bytes, MPOL_BIND_POLICY, &mask, sizeof(mask) * 8 + 1, MPOL_MF_MOVE_FLAG) == 0;
+  }
+
+private:
+  // sysfs list format, e.g. "0-3,8-11"
+  static std::vector<int> _readList(const std::string& path) {
+    std::vector<int> values;
+    std::ifstream in(path);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+      int first = 0, last = 0;
+      int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+      if (fields < 1) continue;
+      if (fields == 1) last = first;
+      for (int value = first; value <= last; value++) values.push_back(value);
+    }
+    return values;
+  }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory
+//
+// Book containers allocate their nodes from a per-thread NodeArena: size class free lists carved out of 2MB aligned
+// chunks. Chunks can be prefaulted before trading starts, freed nodes are recycled rather than handed back to malloc,
+// and each engine thread only touches its own arena. A node freed by a thread other than its owner (e.g. a book
+// spliced in after parallel recovery) is pushed onto the owner's lock free remote list and reclaimed from there, which
+// is also why arenas are never destroyed.
+//----------------------------------------------------------------------------------------------------------------------
+class NodeArena {
+public:
+  static constexpr size_t CHUNK_BYTES = 2 * 1024 * 1024;
+  static constexpr size_t CLASS_BYTES = 16;
+  static constexpr size_t MAX_NODE_BYTES = 256;
+
+  static NodeArena& local();
+
+  void* allocate(size_t bytes);
+  static void deallocate(void* p, size_t bytes);
+
+  // Map and touch spare chunks until `bytes` are reserved, so the first orders after start don't page fault
+  void prefault(size_t bytes);
+
+  size_t reservedBytes() const { return chunks * CHUNK_BYTES; }
+
+  // Bind chunks allocated from now on (including prefaulted ones) to a NUMA node, -1 for the default policy. Chunks
+  // already reserved stay where they are
+  void bindTo(int node) { numaNode = node; }
+
+private:
+  static constexpr size_t CLASSES = MAX_NODE_BYTES / CLASS_BYTES;
+  static constexpr size_t HEADER_BYTES = 64;
+
+  struct FreeNode { FreeNode* next; };
+  struct ChunkHeader { NodeArena* owner; };
+
+  NodeArena() = default;
+  static size_t _sizeClass(size_t bytes) { return (bytes + CLASS_BYTES - 1) / CLASS_BYTES - 1; }
+  char* _newChunk();
+  char* _allocChunk();
+
+private:
+  FreeNode* freeLists[CLASSES] = {};
+  std::atomic<FreeNode*> remoteFrees[CLASSES] = {};
+  char* bump[CLASSES] = {};
+  char* bumpEnd[CLASSES] = {};
+  std::vector<char*> spareChunks;
+  size_t chunks = 0;
+  int numaNode = -1;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+NodeArena& NodeArena::local() {
+  thread_local NodeArena* arena = new NodeArena();
+  return *arena;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void* NodeArena::allocate(size_t bytes) {
+  size_t sizeClass = _sizeClass(bytes);
+
+  FreeNode* node = freeLists[sizeClass];
+  if (node == nullptr && remoteFrees[sizeClass].load(std::memory_order_relaxed) != nullptr) {
+    node = remoteFrees[sizeClass].exchange(nullptr, std::memory_order_acquire);
+  }
+  if (node != nullptr) {
+    freeLists[sizeClass] = node->next;
+    return node;
+  }
+
+  size_t nodeBytes = (sizeClass + 1) * CLASS_BYTES;
+  if (bump[sizeClass] + nodeBytes > bumpEnd[sizeClass]) {
+    char* chunk = _newChunk();
+    bump[sizeClass] = chunk + HEADER_BYTES;
+    bumpEnd[sizeClass] = chunk + CHUNK_BYTES;
+  }
+
+  void* p = bump[sizeClass];
+  bump[sizeClass] += nodeBytes;
+  return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void NodeArena::deallocate(void* p, size_t bytes) {
+  FreeNode* node = static_cast<FreeNode*>(p);
+  size_t sizeClass = _sizeClass(bytes);
+  ChunkHeader* chunk = reinterpret_cast<ChunkHeader*>(reinterpret_cast<uintptr_t>(p) & ~(CHUNK_BYTES - 1));
+  NodeArena* owner = chunk->owner;
+
+  if (owner == &local()) {
+    node->next = owner->freeLists[sizeClass];
+    owner->freeLists[sizeClass] = node;
+    return;
+  }
+
+  node->next = owner->remoteFrees[sizeClass].load(std::memory_order_relaxed);
+  while (!owner->remoteFrees[sizeClass].compare_exchange_weak(node->next, node, std::memory_order_release)) {}
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void NodeArena::prefault(size_t bytes) {
+  // Fresh chunks only: taking spares here would hand the same chunk back every time
+  while (reservedBytes() < bytes) spareChunks.push_back(_allocChunk());
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+char* NodeArena::_newChunk() {
+  if (!spareChunks.empty()) {
+    char* chunk = spareChunks.back();
+    spareChunks.pop_back();
+    return chunk;
+  }
+  return _allocChunk();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+char* NodeArena::_allocChunk() {
+  char* chunk = static_cast<char*>(std::aligned_alloc(CHUNK_BYTES, CHUNK_BYTES));
+  if (chunk == nullptr) throw std::bad_alloc();
+  if (numaNode >= 0) Numa::bind(chunk, CHUNK_BYTES, numaNode);
+  madvise(chunk, CHUNK_BYTES, MADV_HUGEPAGE);
+  for (size_t offset = 0; offset < CHUNK_BYTES; offset += 4096) chunk[offset] = 0;
+
+  reinterpret_cast<ChunkHeader*>(chunk)->owner = this;
+  chunks++;
+  return chunk;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stateless STL allocator over the calling thread's NodeArena. Anything larger than a node (e.g. vector storage) falls
+// through to operator new.
+//----------------------------------------------------------------------------------------------------------------------
+template <typename T>
+struct ArenaAllocator {
+  typedef T value_type;
+
+  ArenaAllocator() = default;
+  template <typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+  static constexpr bool _inArena(size_t n) {
+    return n * sizeof(T) <= NodeArena::MAX_NODE_BYTES && alignof(T) <= NodeArena::CLASS_BYTES;
+  }
+
+  T* allocate(size_t n) {
+    if (_inArena(n)) return static_cast<T*>(NodeArena::local().allocate(n * sizeof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (_inArena(n)) {
+      NodeArena::deallocate(p, n * sizeof(T));
+    } else {
+      ::operator delete(p);
+    }
+  }
+
+  template <typename U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+};
+
 //----------------------------------------------------------------------------------------------------------------------
 // Type Definitions
 //----------------------------------------------------------------------------------------------------------------------
@@ -172,6 +467,11 @@ enum Action {
   PLACE = 'O',
   CANCEL = 'X',
   PRINT = 'P',
+  STATS = 'S',
+  QUEUE = 'Q',
+  QUOTE = 'M',
+  BULK = 'B',
+  HASH = 'H',
 };
 
 enum Side {
@@ -179,6 +479,21 @@ enum Side {
   SELL = 'S',
 };
 
+// Why an action was rejected. Rejects are returned, never thrown: each one becomes an 'E' result and is counted per
+// reason in EngineStats
+enum class RejectReason : uint8_t {
+  NONE,
+  MALFORMED,      // missing or unparseable fields
+  BAD_SIDE,
+  BAD_SYMBOL,
+  BAD_QUANTITY,
+  BAD_PRICE,
+  DUPLICATE_OID,
+  UNKNOWN_OID,    // cancel or queue query of an order not on the book
+  UNKNOWN_ACTION,
+  COUNT
+};
+
 typedef uint32_t OrderId;
 typedef std::string Symbol;
 typedef uint16_t Quantity;
@@ -199,436 +514,6333 @@ struct Order {
     , side(_side)
     , qty(_qty)
     , px(_px)
-    {
-      if (_side != Side::BUY && _side != Side::SELL) {
-        throw std::invalid_argument("Invalid Order Side");
-      }
-    };
+    {};
 };
 
-typedef std::list<Order> OrderQueue;
-typedef std::map<Price, OrderQueue> PriceLevels;
-struct Sides { PriceLevels bids; PriceLevels asks; };
-typedef std::map<Symbol, Sides> OrderBook;
-typedef std::map<OrderId, Order> OrderCache;
-
-struct Fill { OrderId oid; Symbol symbol; Quantity qty; Price px; };
-
 //----------------------------------------------------------------------------------------------------------------------
-// Simple Cross Order Book Driver
+// Order Storage
+//
+// Resting orders live in an OrderPool and are addressed by 32-bit handles. Each price level is an intrusive FIFO
+// threaded through the pooled orders, and every order remembers its level, so cancelling by handle is O(1).
 //----------------------------------------------------------------------------------------------------------------------
-class SimpleCross {
-public:
-  results_t action(const std::string line);
+typedef uint32_t OrderHandle;
+const OrderHandle NO_ORDER = UINT32_MAX;
 
-private:
-  std::vector<Fill> _placeOrder(Order &order);
-  bool _cancelOrder(OrderId oid);
-  void _printSortedBook();
-  void _printFills(std::vector<Fill> fills);
-  void _printCancel(OrderId oid, bool cancelled);
+// Order-statistic view of one level for queue position queries: Fenwick trees over arrival tickets holding each live
+// order's open quantity and a count of one, so the quantity and orders ahead of a ticket are prefix sums. A level only
+// carries one after its first position query, and drops it when it empties
+struct LevelRank {
+  std::vector<int64_t> qty;     // 1-based, slot ticket + 1
+  std::vector<int32_t> orders;
+  uint32_t nextTicket = 0;
 
-  void _placeOrderNewSymbol(Order &order);
-  std::vector<Fill> _placeOrderExistingSymbol(Order &order);
-  std::vector<Fill> _fillOrder(Order &order);
-  std::vector<Fill> _fillBid(Order &order);
-  std::vector<Fill> _fillAsk(Order &order);
-  void _validateOrderId(const OrderId orderId);
+  explicit LevelRank(size_t capacity) : qty(capacity + 1), orders(capacity + 1) {}
 
-  std::vector<std::string> _splitLine(const std::string line, const char delim=' ');
+  bool full() const { return nextTicket + 1 >= qty.size(); }
 
-  template<typename T> void _log(T t) { if (debug) { log(t); } }
-  void _logSortedBook();
+  void add(uint32_t ticket, int64_t deltaQty, int32_t deltaOrders) {
+    for (size_t i = ticket + 1; i < qty.size(); i += i & -i) {
+      qty[i] += deltaQty;
+      orders[i] += deltaOrders;
+    }
+  }
 
-private:
-  OrderBook orderBook;
-  OrderCache orderCache;
-  
-  bool debug = false;
+  // Open quantity and orders with a ticket below `ticket`
+  std::pair<int64_t, int32_t> ahead(uint32_t ticket) const {
+    std::pair<int64_t, int32_t> sum(0, 0);
+    for (size_t i = ticket; i > 0; i -= i & -i) {
+      sum.first += qty[i];
+      sum.second += orders[i];
+    }
+    return sum;
+  }
 };
 
-//----------------------------------------------------------------------------------------------------------------------
-results_t SimpleCross::action(const std::string line) {
-  std::vector<std::string> instructions = _splitLine(line);
-  Action action = static_cast<Action>(instructions[0][0]);
-  if (action == Action::PLACE) {
-    Order order = Order(
-      static_cast<OrderId>(std::stoi(instructions[1])),
-      static_cast<Symbol>(instructions[2]),
-      static_cast<Side>(instructions[3].front()),
-      static_cast<Quantity>(std::stoi(instructions[4])),
-      static_cast<Price>(std::stod(instructions[5]))
-    );
-    std::vector<Fill> fills = _placeOrder(order);
-    _printFills(fills);
-  } else if (action == Action::CANCEL) {
-    bool cancelled = _cancelOrder(
-      static_cast<OrderId>(std::stoi(instructions[1]))
-    );
-    _printCancel(static_cast<OrderId>(std::stoi(instructions[1])), cancelled);
-  } else if (action == Action::PRINT) {
-    _printSortedBook();
-  }
+struct OrderQueue {
+  OrderHandle head = NO_ORDER;
+  OrderHandle tail = NO_ORDER;
+  uint32_t count = 0;
+  std::unique_ptr<LevelRank> rank; // see LevelRank, null until queried
 
-  if (debug) _logSortedBook();
+  bool empty() const { return count == 0; }
+};
 
-  return results_t();
-}
+typedef uint32_t SymbolId;
+
+struct RestingOrder {
+  Order order;
+  SymbolId symbolId;
+  OrderHandle prev;
+  OrderHandle next; // also links the pool's free list
+  uint32_t ticket;  // arrival order within the level, only maintained while the level has a LevelRank
+  uint32_t owner;   // quoting market maker, 0 for plain orders
+  OrderQueue* queue; // its level's queue
+};
 
 //----------------------------------------------------------------------------------------------------------------------
-std::vector<Fill> SimpleCross::_placeOrder(Order &order) {
-  _validateOrderId(order.oid);
+// Chunked so growing never moves resting orders and a handle resolves with a shift and a mask
+//----------------------------------------------------------------------------------------------------------------------
+class OrderPool {
+public:
+  RestingOrder& operator[](OrderHandle handle) { return chunks[handle >> CHUNK_BITS][handle & CHUNK_MASK]; }
+  const RestingOrder& operator[](OrderHandle handle) const { return chunks[handle >> CHUNK_BITS][handle & CHUNK_MASK]; }
 
-  std::vector<Fill> fills;
+  OrderHandle acquire();
+  void release(OrderHandle handle);
 
-  // Note: In a real system, all the traded symbols would probably be loaded on startup,
-  //       but given the problem constraints, we will generate the book on the fly
-  if (orderBook.find(order.symbol) == orderBook.end()) {
-    _placeOrderNewSymbol(order);
-  } else {
-    fills = _placeOrderExistingSymbol(order);
-  }
+  // Take handles [0, count) at once, those resting(handle) is true for as acquired and the rest free, so orders can
+  // be put back at the handles they had (attaching a BookImage). Only for an empty pool
+  template<typename Resting> void adopt(OrderHandle count, Resting resting);
 
-  if (order.qty != 0) {
-    orderCache.insert(std::pair<OrderId, Order>(order.oid, order));
+  void pushBack(OrderQueue& queue, OrderHandle handle);
+  void unlink(OrderQueue& queue, OrderHandle handle);
+
+  // Open quantity and number of orders queued ahead of `handle` at its level. The first query at a level ranks it with
+  // one walk; from then on pushBack, unlink and reduce keep the rank current and a query is a pair of prefix sums
+  std::pair<int64_t, int32_t> position(OrderQueue& queue, OrderHandle handle);
+
+  // Take `qty` off a resting order that stays queued (a partial fill)
+  void reduce(OrderQueue& queue, OrderHandle handle, Quantity qty) {
+    (*this)[handle].order.qty -= qty;
+    if (queue.rank) [[unlikely]] queue.rank->add((*this)[handle].ticket, -static_cast<int64_t>(qty), 0);
   }
 
-  return fills;
-}
+  // Allocate and touch chunks for at least `orders` resting orders
+  void reserve(size_t orders);
 
-//----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_placeOrderNewSymbol(Order &order) {
-  _log("Symbol " + order.symbol + " not in book. Adding it now.");
-  // Create Order Queue
-  OrderQueue orderQueue;
-  orderQueue.emplace_back(order);
+  size_t live() const { return liveOrders; }
+  size_t capacity() const { return chunks.size() << CHUNK_BITS; }
 
-  // Create PriceLevels and insert first price level
-  PriceLevels bidPxLevels, askPxLevels;
-  if (order.side == Side::BUY) {
-    bidPxLevels.insert(std::pair<Price, OrderQueue>(order.px, orderQueue));
-  } else if (order.side == Side::SELL) {
-    askPxLevels.insert(std::pair<Price, OrderQueue>(order.px, orderQueue));
-  }
+  void prefetch(OrderHandle handle) const { if (handle != NO_ORDER) __builtin_prefetch(&(*this)[handle], 1); }
+
+private:
+  static constexpr unsigned CHUNK_BITS = 16;
+  static constexpr OrderHandle CHUNK_MASK = (1u << CHUNK_BITS) - 1;
 
-  Sides sides;
-  sides.bids = bidPxLevels;
-  sides.asks = askPxLevels;
+  void _addChunk();
+  void _rank(OrderQueue& queue);
 
-  orderBook.insert(std::pair<Symbol, Sides>(order.symbol, sides));
-}
+private:
+  std::vector<std::unique_ptr<RestingOrder[]>> chunks;
+  OrderHandle freeHead = NO_ORDER;
+  OrderHandle fresh = 0; // next never used handle
+  size_t liveOrders = 0;
+};
 
 //----------------------------------------------------------------------------------------------------------------------
-std::vector<Fill> SimpleCross::_placeOrderExistingSymbol(Order &order) {
-  _log("Symbol found!");
+OrderHandle OrderPool::acquire() {
+  liveOrders++;
+  if (freeHead != NO_ORDER) {
+    OrderHandle handle = freeHead;
+    freeHead = (*this)[handle].next;
+    return handle;
+  }
 
-  // First attempt to fill order
-  std::vector<Fill> fills = _fillOrder(order);
+  if (fresh == capacity()) _addChunk();
+  return fresh++;
+}
 
-  if (order.qty != 0) { // order was not completely filled
-    PriceLevels& pxLevels = order.side == Side::BUY
-      ? orderBook[order.symbol].bids
-      : orderBook[order.symbol].asks;
+//----------------------------------------------------------------------------------------------------------------------
+void OrderPool::release(OrderHandle handle) {
+  liveOrders--;
+  (*this)[handle].next = freeHead;
+  freeHead = handle;
+}
 
-    // New price level
-    if (pxLevels.find(order.px) == pxLevels.end()) {
-      OrderQueue orderQueue;
-      orderQueue.emplace_back(order);
-      pxLevels.insert(std::pair<Price, OrderQueue>(order.px, orderQueue));
-    // Existing price level
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Resting>
+void OrderPool::adopt(OrderHandle count, Resting resting) {
+  reserve(count);
+  fresh = count;
+  // Lowest free handle first, as a pool that had only ever grown would hand them out
+  for (OrderHandle handle = count; handle-- > 0;) {
+    if (resting(handle)) {
+      liveOrders++;
     } else {
-      pxLevels[order.px].emplace_back(order);
+      (*this)[handle].next = freeHead;
+      freeHead = handle;
     }
   }
-
-  return fills;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-bool SimpleCross::_cancelOrder(OrderId oid) {
-  _log("Cancelling order: " + std::to_string(oid));
-
-  Order order;
-  try {
-    order = orderCache.at(oid);
-  } catch (const std::out_of_range& oor) {
-    return false;
+void OrderPool::pushBack(OrderQueue& queue, OrderHandle handle) {
+  RestingOrder& node = (*this)[handle];
+  node.prev = queue.tail;
+  node.next = NO_ORDER;
+  if (queue.tail != NO_ORDER) {
+    (*this)[queue.tail].next = handle;
+  } else {
+    queue.head = handle;
   }
+  queue.tail = handle;
+  queue.count++;
 
-  PriceLevels& pxLevels = order.side == Side::BUY
-    ? orderBook[order.symbol].bids
-    : orderBook[order.symbol].asks;
-
-  OrderQueue& orderQueue = pxLevels[order.px];
-  
-  auto it = orderQueue.begin();
-  while (it != orderQueue.end()) {
-    if (it->oid == oid) {
-      break;
+  if (queue.rank) [[unlikely]] {
+    if (queue.rank->full()) {
+      _rank(queue);
+    } else {
+      node.ticket = queue.rank->nextTicket++;
+      queue.rank->add(node.ticket, node.order.qty, 1);
     }
-    it++;
   }
+}
 
-  orderQueue.erase(it);
-  if (orderQueue.empty()) {
-    pxLevels.erase(order.px);
+//----------------------------------------------------------------------------------------------------------------------
+void OrderPool::unlink(OrderQueue& queue, OrderHandle handle) {
+  RestingOrder& node = (*this)[handle];
+  if (node.prev != NO_ORDER) {
+    (*this)[node.prev].next = node.next;
+  } else {
+    queue.head = node.next;
   }
+  if (node.next != NO_ORDER) {
+    (*this)[node.next].prev = node.prev;
+  } else {
+    queue.tail = node.prev;
+  }
+  queue.count--;
 
-  return true;
-}
-
-/*---------------------------------------------------------------------------------------------------------------------
-// Attempt to fill order in place. qty in out paramater, order, will be the remaining unfilled shares
-// TODO: The buy and ask branches are similar. Could potentially generalize with templates
-//---------------------------------------------------------------------------------------------------------------------*/
-std::vector<Fill> SimpleCross::_fillOrder(Order &order) {
-  if (order.side == Side::BUY) {
-    return _fillBid(order);
-  } else if (order.side == Side::SELL) {
-    return _fillAsk(order);
+  if (queue.rank) [[unlikely]] {
+    if (queue.count == 0) {
+      queue.rank.reset();
+    } else {
+      queue.rank->add(node.ticket, -static_cast<int64_t>(node.order.qty), -1);
+    }
   }
+}
 
-  return std::vector<Fill>();
+//----------------------------------------------------------------------------------------------------------------------
+std::pair<int64_t, int32_t> OrderPool::position(OrderQueue& queue, OrderHandle handle) {
+  if (!queue.rank) _rank(queue);
+  return queue.rank->ahead((*this)[handle].ticket);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-std::vector<Fill> SimpleCross::_fillBid(Order &order) {
-  _log("Attempting to fill bid!");
+void OrderPool::reserve(size_t orders) {
+  while (capacity() < orders) _addChunk();
+}
 
-  std::vector<Fill> fills;
+//----------------------------------------------------------------------------------------------------------------------
+void OrderPool::_addChunk() {
+  chunks.emplace_back(new RestingOrder[1u << CHUNK_BITS]);
+}
 
-  // Already know symbol is in orderBook from calling function
-  PriceLevels& askPxLevels = orderBook[order.symbol].asks;
-  std::vector<Price> pxLevelsToDrop = {};
+//----------------------------------------------------------------------------------------------------------------------
+// (Re)number the level's orders from zero into a rank with room for as many arrivals again, so the walk is paid once
+// per doubling of the level and tickets never outgrow the trees
+//----------------------------------------------------------------------------------------------------------------------
+void OrderPool::_rank(OrderQueue& queue) {
+  const size_t MIN_RANK_CAPACITY = 16;
 
-  for (std::pair<Price, OrderQueue> aPxLevel : askPxLevels) {
-    Price askPrice = aPxLevel.first;
-    OrderQueue& askOrderQueue = aPxLevel.second;
-    int ordersToPop = 0;
+  size_t capacity = MIN_RANK_CAPACITY;
+  while (capacity < 2 * size_t(queue.count)) capacity *= 2;
+  queue.rank = std::make_unique<LevelRank>(capacity);
 
-    if (order.px >= askPrice) {
-      for (Order& restingOrder : askOrderQueue) {
-        Quantity sharesExecuted = std::min(restingOrder.qty, order.qty);
-        order.qty -= sharesExecuted;
-        restingOrder.qty -= sharesExecuted;
+  for (OrderHandle handle = queue.head; handle != NO_ORDER; handle = (*this)[handle].next) {
+    RestingOrder& node = (*this)[handle];
+    node.ticket = queue.rank->nextTicket++;
+    queue.rank->add(node.ticket, node.order.qty, 1);
+  }
+}
 
-        if (sharesExecuted > 0) {
-          _log("Crossed " + std::to_string(sharesExecuted) + " shared with order " + std::to_string(restingOrder.oid));
-        
-          Fill fill;
-          fill.oid = restingOrder.oid;
-          fill.symbol = restingOrder.symbol;
-          fill.qty = sharesExecuted;
-          fill.px = restingOrder.px;
-          fills.push_back(fill);
-        }
+//----------------------------------------------------------------------------------------------------------------------
+// OID to order handle. Gateways assign OIDs sequentially per session, so the 32-bit OID space is dense within a few
+// ranges: a page table keyed by the high bits points at direct-mapped pages of handles, and a lookup is two dependent
+// loads with no hashing or tree walk. Pages are allocated when the first OID in their range arrives and freed when
+// their last order leaves the book, keeping a few spares so a session rolling into its next page doesn't allocate.
+//
+// OIDs are unique for all orders, not just live ones, so the index also keeps a bit for every OID it has ever held,
+// set on insert and kept after the order leaves. The bits are paged the same way, 512 bytes per page of handles, and
+// their pages are never freed; reserve() sets aside as many of them as of handle pages.
+//----------------------------------------------------------------------------------------------------------------------
+class OrderIndex {
+public:
+  OrderIndex();
+  ~OrderIndex();
+  OrderIndex(const OrderIndex&) = delete;
+  OrderIndex& operator=(const OrderIndex&) = delete;
 
-        if (restingOrder.qty == 0) ordersToPop++;
-        if (order.qty == 0) break;
-      }
+  OrderHandle find(OrderId oid) const {
+    const Page* page = table[oid >> PAGE_BITS];
+    return page != nullptr ? page->handles[oid & PAGE_MASK] : NO_ORDER;
+  }
+  // oid has been inserted at some point, whether or not it is still live
+  bool seen(OrderId oid) const {
+    const SeenPage* page = seenTable[oid >> PAGE_BITS];
+    return page != nullptr && (page->bits[(oid & PAGE_MASK) >> 6] >> (oid & 63) & 1);
+  }
 
-      // Clear resting orders with zero shares left
-      for (int i=0; i < ordersToPop; i++) askOrderQueue.pop_back();
-    }
+  static constexpr size_t PAGE_ORDERS = size_t(1) << 12; // OIDs per page
 
-    if (askOrderQueue.empty()) pxLevelsToDrop.push_back(askPrice);
-    if (order.qty == 0) break;
-  }
+  void insert(OrderId oid, OrderHandle handle);
+  void erase(OrderId oid);
+  // Add every OID other has seen, e.g. from the scratch engines of parallel recovery
+  void mergeSeen(const OrderIndex& other);
 
-  // Clear price levels for which there are no longer resting orders
-  for (Price px : pxLevelsToDrop) askPxLevels.erase(px);
+  // Keep `pages` spare pages allocated and touched
+  void reserve(size_t pages);
 
-  return fills;
-}
+  size_t size() const { return entries; }
+  size_t pages() const { return livePages; }
+  size_t capacity() const { return livePages << PAGE_BITS; }
 
-//----------------------------------------------------------------------------------------------------------------------
-std::vector<Fill> SimpleCross::_fillAsk(Order &order) {
-  _log("Attempting to fill ask!");
+  // The two loads of find(), as separate prefetch stages for batched lookups
+  void prefetchTable(OrderId oid) const { __builtin_prefetch(&table[oid >> PAGE_BITS]); }
+  void prefetchHandle(OrderId oid) const {
+    const Page* page = table[oid >> PAGE_BITS];
+    if (page != nullptr) __builtin_prefetch(&page->handles[oid & PAGE_MASK]);
+  }
 
-  std::vector<Fill> fills;
+private:
+  static constexpr unsigned PAGE_BITS = 12;
+  static_assert(PAGE_ORDERS == size_t(1) << PAGE_BITS);
+  static constexpr OrderId PAGE_MASK = (1u << PAGE_BITS) - 1;
+  static constexpr size_t TABLE_SIZE = size_t(1) << (32 - PAGE_BITS);
+  static constexpr size_t MAX_SPARE_PAGES = 16;
 
-  // Already know symbol is in orderBook from calling function
-  PriceLevels& bidPxLevels = orderBook[order.symbol].bids;
-  std::vector<Price> pxLevelsToDrop = {};
+  struct Page {
+    OrderHandle handles[1u << PAGE_BITS];
+    uint32_t live;
+  };
+  struct SeenPage {
+    uint64_t bits[(1u << PAGE_BITS) / 64];
+  };
 
-  // Iterate in reverse order because bidPxLevels.end() is most competitive price
-  for (auto pxLevelIt = bidPxLevels.rbegin(); pxLevelIt != bidPxLevels.rend(); ++pxLevelIt) {
-    Price bidPrice = pxLevelIt->first;
-    OrderQueue& bidOrderQueue = pxLevelIt->second;
-    int ordersToPop = 0;
+  Page* _newPage();
+  SeenPage* _seenPage(OrderId oid);
 
-    if (order.px <= bidPrice) {
-      _log("Crossing order!");
-      for (Order& restingOrder : bidOrderQueue) {
-        Quantity sharesExecuted = std::min(restingOrder.qty, order.qty);
-        order.qty -= sharesExecuted;
-        restingOrder.qty -= sharesExecuted;
-
-        if (sharesExecuted > 0) {
-          _log("Crossed " + std::to_string(sharesExecuted) + " with order " + std::to_string(restingOrder.oid));
-        
-          Fill fill;
-          fill.oid = restingOrder.oid;
-          fill.symbol = restingOrder.symbol;
-          fill.qty = sharesExecuted;
-          fill.px = restingOrder.px;
-          fills.push_back(fill);
-        }
+private:
+  Page** table; // TABLE_SIZE entries, calloc'd so untouched ranges cost no memory
+  SeenPage** seenTable; // likewise
+  std::vector<Page*> sparePages;
+  std::vector<SeenPage*> spareSeenPages;
+  size_t entries = 0;
+  size_t livePages = 0;
+  size_t seenPages = 0;
+};
 
-        if (restingOrder.qty == 0) ordersToPop++;
-        if (order.qty == 0) break;
-      }
+//----------------------------------------------------------------------------------------------------------------------
+OrderIndex::OrderIndex() {
+  table = static_cast<Page**>(std::calloc(TABLE_SIZE, sizeof(Page*)));
+  seenTable = static_cast<SeenPage**>(std::calloc(TABLE_SIZE, sizeof(SeenPage*)));
+  if (table == nullptr || seenTable == nullptr) {
+    std::free(table);
+    std::free(seenTable);
+    throw std::bad_alloc();
+  }
+}
 
-      // Clear resting orders with zero shares left
-      for (int i=0; i < ordersToPop; i++) bidOrderQueue.pop_back();
+//----------------------------------------------------------------------------------------------------------------------
+OrderIndex::~OrderIndex() {
+  for (size_t i = 0; i < TABLE_SIZE && livePages != 0; i++) {
+    if (table[i] != nullptr) {
+      delete table[i];
+      livePages--;
     }
+  }
+  for (Page* page : sparePages) delete page;
+  std::free(table);
 
-    if (bidOrderQueue.empty()) pxLevelsToDrop.push_back(bidPrice);
-    if (order.qty == 0) break;
+  for (size_t i = 0; i < TABLE_SIZE && seenPages != 0; i++) {
+    if (seenTable[i] != nullptr) {
+      delete seenTable[i];
+      seenPages--;
+    }
   }
+  for (SeenPage* page : spareSeenPages) delete page;
+  std::free(seenTable);
+}
 
-  // Clear price levels for which there are no longer resting orders
-  for (Price px : pxLevelsToDrop) bidPxLevels.erase(px);
+//----------------------------------------------------------------------------------------------------------------------
+void OrderIndex::insert(OrderId oid, OrderHandle handle) {
+  Page*& page = table[oid >> PAGE_BITS];
+  if (page == nullptr) {
+    page = _newPage();
+    livePages++;
+  }
 
-  return fills;
+  OrderHandle& slot = page->handles[oid & PAGE_MASK];
+  if (slot == NO_ORDER) {
+    page->live++;
+    entries++;
+  }
+  slot = handle;
+  _seenPage(oid)->bits[(oid & PAGE_MASK) >> 6] |= uint64_t(1) << (oid & 63);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_validateOrderId(const OrderId orderId) {
-  for (std::pair<OrderId, Order> cachedOrder : orderCache) {
-    if (cachedOrder.first == orderId) {
-      throw std::invalid_argument("Invalid Order ID");
-    }
+void OrderIndex::mergeSeen(const OrderIndex& other) {
+  size_t remaining = other.seenPages;
+  for (size_t i = 0; i < TABLE_SIZE && remaining != 0; i++) {
+    const SeenPage* from = other.seenTable[i];
+    if (from == nullptr) continue;
+    SeenPage* to = _seenPage(static_cast<OrderId>(i << PAGE_BITS));
+    for (size_t word = 0; word < std::size(to->bits); word++) to->bits[word] |= from->bits[word];
+    remaining--;
   }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_printFills(std::vector<Fill> fills) {
-  for (Fill fill : fills) {
-    log("F "
-      + std::to_string(fill.oid) + " "
-      + fill.symbol + " "
-      + std::to_string(fill.qty) + " "
-      + std::to_string(fill.px)
-    );
+void OrderIndex::erase(OrderId oid) {
+  Page*& page = table[oid >> PAGE_BITS];
+  if (page == nullptr || page->handles[oid & PAGE_MASK] == NO_ORDER) return;
+
+  page->handles[oid & PAGE_MASK] = NO_ORDER;
+  entries--;
+  if (--page->live == 0) {
+    if (sparePages.size() < MAX_SPARE_PAGES) {
+      sparePages.push_back(page);
+    } else {
+      delete page;
+    }
+    page = nullptr;
+    livePages--;
   }
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_printCancel(OrderId oid, bool cancelled) {
-  if (cancelled) {
-    log("X " + std::to_string(oid));
-  } else {
-    log("E " + std::to_string(oid) + " Order ID not on book");
+void OrderIndex::reserve(size_t pages) {
+  while (sparePages.size() < pages) {
+    Page* page = new Page;
+    std::fill(std::begin(page->handles), std::end(page->handles), NO_ORDER);
+    page->live = 0;
+    sparePages.push_back(page);
   }
+  while (spareSeenPages.size() < pages) spareSeenPages.push_back(new SeenPage());
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_printSortedBook() {
-  if (orderBook.empty()) {
-    log("Book empty!");
-    return;
+OrderIndex::Page* OrderIndex::_newPage() {
+  // Spare pages are only ever returned fully erased
+  if (!sparePages.empty()) {
+    Page* page = sparePages.back();
+    sparePages.pop_back();
+    return page;
   }
 
-  for (std::pair<Symbol, Sides> symbolSides : orderBook) {
-    Symbol symbol = symbolSides.first;
-
-    Side side = Side::SELL;
-    for (auto pxLevelIt = symbolSides.second.asks.rbegin(); pxLevelIt != symbolSides.second.asks.rend(); ++pxLevelIt) {
-      Price price = pxLevelIt->first;
-      for (Order order : pxLevelIt->second) {
-        log("P "
-          + std::to_string(order.oid) + " "
-          + symbol + " "
-          + std::string(1, side) + " "
-          + std::to_string(order.qty) + " "
-          + std::to_string(price)
-        );
-      }
-    }
+  Page* page = new Page;
+  std::fill(std::begin(page->handles), std::end(page->handles), NO_ORDER);
+  page->live = 0;
+  return page;
+}
 
-    side = Side::BUY;
-    for (auto pxLevelIt = symbolSides.second.bids.rbegin(); pxLevelIt != symbolSides.second.bids.rend(); ++pxLevelIt) {
-      Price price = pxLevelIt->first;
-      for (Order order : pxLevelIt->second) {
-        log("P "
-          + std::to_string(order.oid) + " "
-          + symbol + " "
-          + std::string(1, side) + " "
-          + std::to_string(order.qty) + " "
-          + std::to_string(price)
-        );
-      }
+//----------------------------------------------------------------------------------------------------------------------
+OrderIndex::SeenPage* OrderIndex::_seenPage(OrderId oid) {
+  SeenPage*& page = seenTable[oid >> PAGE_BITS];
+  if (page == nullptr) {
+    if (!spareSeenPages.empty()) {
+      page = spareSeenPages.back();
+      spareSeenPages.pop_back();
+    } else {
+      page = new SeenPage();
     }
+    seenPages++;
   }
+  return page;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-std::vector<std::string> SimpleCross::_splitLine(const std::string line, const char delim) {
-  std::vector<std::string> ret{};
+// Price Levels
+//
+// A side of a book is an ordered container of price -> OrderQueue with the subset of the std::map interface the
+// matcher uses: try_emplace (plain and hinted), bidirectional iterators in ascending price order that stay valid
+// across inserts, size, and erase_if for the bulk reclaim. The engine is a template over the container, so each
+// symbol class can pick the layout that suits its books:
+//
+//   MapLevels     red-black tree, the general purpose default
+//   FlatLevels    sorted vector of level pointers with the best price at the back, cheap when levels come and go near
+//                 the top of the book and the book is shallow
+//   BTreeLevels   B+tree with linked leaves, for deep books where a tree's node hopping dominates
+//   LadderLevels  dense array of price ticks around the traded band, constant time insert and lookup for instruments
+//                 that stay on a known tick grid; prices off the grid or outside the band go to an ordered overflow
+//
+// Apart from MapLevels, levels live in arena allocated LevelNodes that never move, which is what keeps iterators and
+// the best level handles in BookHot valid while the container reorganises around them.
+//----------------------------------------------------------------------------------------------------------------------
+typedef std::map<Price, OrderQueue, std::less<Price>, ArenaAllocator<std::pair<const Price, OrderQueue>>> MapLevels;
 
-  std::istringstream iss(line);
-  std::string item = "";
-  
-  while (std::getline(iss, item, delim)) {
-      ret.emplace_back(item);
+enum class LevelsKind { MAP, FLAT, BTREE, LADDER };
+
+struct LevelNode {
+  std::pair<const Price, OrderQueue> value;
+  int64_t slot = 0;      // position in the container: vector index, leaf index or ladder tick
+  void* leaf = nullptr;  // BTreeLevels only
+
+  explicit LevelNode(Price px) : value(px, OrderQueue()) {}
+
+  static LevelNode* create(Price px) {
+    ArenaAllocator<LevelNode> allocator;
+    return new (allocator.allocate(1)) LevelNode(px);
   }
 
-  return ret;
-}
+  static void destroy(LevelNode* node) {
+    node->~LevelNode();
+    ArenaAllocator<LevelNode>().deallocate(node, 1);
+  }
+};
 
 //----------------------------------------------------------------------------------------------------------------------
-void SimpleCross::_logSortedBook() {
-  if (orderBook.empty()) {
-    log("Book empty!");
-    return;
-  }
+// Iterator over LevelNodes, stepping through the owning container's next() and prev(). The null node is end(), and
+// prev(end()) is the last level, so reverse iteration works as it does for std::map
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels, bool Const>
+class LevelIterator {
+public:
+  typedef std::bidirectional_iterator_tag iterator_category;
+  typedef std::pair<const Price, OrderQueue> value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef std::conditional_t<Const, const value_type*, value_type*> pointer;
+  typedef std::conditional_t<Const, const value_type&, value_type&> reference;
 
-  const std::string INDENT_1 = "|--";
-  const std::string INDENT_2 = "|   ";
-  const std::string INDENT_3 = "|    ";
-  const std::string INDENT_4 = "|     ";
+  LevelIterator() = default;
+  LevelIterator(const Levels* _levels, LevelNode* _node) : levels(_levels), node(_node) {}
+  operator LevelIterator<Levels, true>() const requires (!Const) { return { levels, node }; }
 
-  log(" ________________________");
-  log("| Order Book");
-  for (std::pair<Symbol, Sides> symbolSides : orderBook) {
-    log(INDENT_1 + symbolSides.first);
+  reference operator*() const { return node->value; }
+  pointer operator->() const { return &node->value; }
 
-    log(INDENT_2 + "Asks");
-    if (symbolSides.second.asks.empty()) log(INDENT_3 + "[EMPTY]");
-    for (auto pxLevelIt = symbolSides.second.asks.rbegin(); pxLevelIt != symbolSides.second.asks.rend(); ++pxLevelIt) {
-      log(INDENT_3 + "$" + std::to_string(pxLevelIt->first));
-      log(INDENT_4 + "OID\tQTY");
-      for (Order order : pxLevelIt->second) {
-        log(INDENT_4 + std::to_string(order.oid) + "\t" + std::to_string(order.qty));
-      }
-    }
+  LevelIterator& operator++() { node = levels->next(node); return *this; }
+  LevelIterator& operator--() { node = levels->prev(node); return *this; }
+  LevelIterator operator++(int) { LevelIterator old = *this; ++*this; return old; }
+  LevelIterator operator--(int) { LevelIterator old = *this; --*this; return old; }
 
-    log(INDENT_2 + "Bids");
-    if (symbolSides.second.bids.empty()) log(INDENT_3 + "[EMPTY]");
-    for (auto pxLevelIt = symbolSides.second.bids.rbegin(); pxLevelIt != symbolSides.second.bids.rend(); ++pxLevelIt) {
+  bool operator==(const LevelIterator& other) const { return node == other.node; }
+
+  LevelNode* levelNode() const { return node; }
+
+private:
+  const Levels* levels = nullptr;
+  LevelNode* node = nullptr;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// The container interface shared by the LevelNode backends. Levels provides first(), last(), next(), prev(),
+// _find(px, hint) returning the node or where to insert it, _insert, and _eraseIf
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+class LevelContainer {
+public:
+  typedef LevelIterator<Levels, false> iterator;
+  typedef LevelIterator<Levels, true> const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  LevelContainer() = default;
+  LevelContainer(const LevelContainer&) = delete;
+  LevelContainer& operator=(const LevelContainer&) = delete;
+
+  iterator begin() { return { _self(), _self()->first() }; }
+  iterator end() { return { _self(), nullptr }; }
+  const_iterator begin() const { return { _self(), _self()->first() }; }
+  const_iterator end() const { return { _self(), nullptr }; }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+  size_t size() const { return levels; }
+  bool empty() const { return levels == 0; }
+
+  std::pair<iterator, bool> try_emplace(Price px) { return _emplace(px, nullptr); }
+  iterator try_emplace(const_iterator hint, Price px) { return _emplace(px, hint.levelNode()).first; }
+
+  template<typename Pred> friend size_t erase_if(Levels& container, Pred pred) { return container._erase(pred); }
+
+protected:
+  size_t levels = 0;
+
+private:
+  Levels* _self() { return static_cast<Levels*>(this); }
+  const Levels* _self() const { return static_cast<const Levels*>(this); }
+
+  template<typename Pred> size_t _erase(Pred pred) {
+    size_t erased = _self()->_eraseIf([&](LevelNode* node) { return pred(std::as_const(node->value)); });
+    levels -= erased;
+    return erased;
+  }
+
+  std::pair<iterator, bool> _emplace(Price px, LevelNode* hint) {
+    auto [node, found] = _self()->_find(px, hint);
+    if (found) return { iterator(_self(), node), false };
+    LevelNode* created = LevelNode::create(px);
+    _self()->_insert(created, node);
+    levels++;
+    return { iterator(_self(), created), true };
+  }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sorted vector of nodes kept so the side's best price is at the back: ascending for bids, descending for asks. New
+// levels mostly appear near the top of the book, so inserts shift a few pointers, and the hint (the level next to the
+// old best) lets a new best price skip the search.
+//----------------------------------------------------------------------------------------------------------------------
+class FlatLevels : public LevelContainer<FlatLevels> {
+public:
+  explicit FlatLevels(Side side=Side::BUY) : ascending(side == Side::BUY) {}
+  ~FlatLevels() { for (LevelNode* node : nodes) LevelNode::destroy(node); }
+
+  LevelNode* first() const { return nodes.empty() ? nullptr : ascending ? nodes.front() : nodes.back(); }
+  LevelNode* last() const { return nodes.empty() ? nullptr : ascending ? nodes.back() : nodes.front(); }
+
+  LevelNode* next(LevelNode* node) const {
+    size_t i = node->slot;
+    if (ascending) return i + 1 < nodes.size() ? nodes[i + 1] : nullptr;
+    return i > 0 ? nodes[i - 1] : nullptr;
+  }
+
+  LevelNode* prev(LevelNode* node) const {
+    if (node == nullptr) return last();
+    size_t i = node->slot;
+    if (ascending) return i > 0 ? nodes[i - 1] : nullptr;
+    return i + 1 < nodes.size() ? nodes[i + 1] : nullptr;
+  }
+
+private:
+  friend class LevelContainer<FlatLevels>;
+
+  // Storage order: true when a sits nearer the front than b
+  bool _before(Price a, Price b) const { return ascending ? a < b : a > b; }
+
+  // The node at px, or the node the new level goes in front of (null for the back)
+  std::pair<LevelNode*, bool> _find(Price px, LevelNode* hint) {
+    auto at = [&](size_t i) -> std::pair<LevelNode*, bool> {
+      if (i == nodes.size()) return { nullptr, false };
+      return { nodes[i], nodes[i]->value.first == px };
+    };
+
+    if (nodes.empty() || _before(nodes.back()->value.first, px)) return at(nodes.size());
+    if (hint != nullptr && !_before(hint->value.first, px)
+        && (hint->slot == 0 || _before(nodes[hint->slot - 1]->value.first, px))) {
+      return at(hint->slot);
+    }
+    auto it = std::lower_bound(nodes.begin(), nodes.end(), px, [&](const LevelNode* node, Price value) {
+      return _before(node->value.first, value);
+    });
+    return at(it - nodes.begin());
+  }
+
+  void _insert(LevelNode* node, LevelNode* before) {
+    size_t i = before == nullptr ? nodes.size() : before->slot;
+    nodes.insert(nodes.begin() + i, node);
+    for (; i < nodes.size(); i++) nodes[i]->slot = i;
+  }
+
+  template<typename Pred> size_t _eraseIf(Pred pred) {
+    size_t kept = 0;
+    for (LevelNode* node : nodes) {
+      if (pred(node)) {
+        LevelNode::destroy(node);
+      } else {
+        node->slot = kept;
+        nodes[kept++] = node;
+      }
+    }
+    size_t erased = nodes.size() - kept;
+    nodes.resize(kept);
+    return erased;
+  }
+
+private:
+  std::vector<LevelNode*> nodes;
+  bool ascending;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// B+tree of nodes. Leaves are linked for iteration and every node knows its leaf and index, so stepping is O(1).
+// Levels are only ever erased in bulk, and the reclaim rebuilds the tree from the surviving leaves bottom up, so the
+// tree never needs deletion rebalancing.
+//----------------------------------------------------------------------------------------------------------------------
+class BTreeLevels : public LevelContainer<BTreeLevels> {
+public:
+  BTreeLevels() = default;
+  ~BTreeLevels() { _clear(true); }
+
+  LevelNode* first() const { return head != nullptr ? head->nodes[0] : nullptr; }
+  LevelNode* last() const { return tail != nullptr ? tail->nodes[tail->count - 1] : nullptr; }
+
+  LevelNode* next(LevelNode* node) const {
+    const Leaf* leaf = static_cast<const Leaf*>(node->leaf);
+    if (node->slot + 1 < leaf->count) return leaf->nodes[node->slot + 1];
+    return leaf->next != nullptr ? leaf->next->nodes[0] : nullptr;
+  }
+
+  LevelNode* prev(LevelNode* node) const {
+    if (node == nullptr) return last();
+    const Leaf* leaf = static_cast<const Leaf*>(node->leaf);
+    if (node->slot > 0) return leaf->nodes[node->slot - 1];
+    return leaf->prev != nullptr ? leaf->prev->nodes[leaf->prev->count - 1] : nullptr;
+  }
+
+private:
+  friend class LevelContainer<BTreeLevels>;
+
+  // Sized so leaves and inner nodes fit the arena's node classes
+  static constexpr unsigned LEAF_SLOTS = 16;
+  static constexpr unsigned INNER_SLOTS = 15;
+  static constexpr unsigned MAX_HEIGHT = 16;
+
+  struct Leaf {
+    Leaf* prev = nullptr;
+    Leaf* next = nullptr;
+    uint32_t count = 0;
+    LevelNode* nodes[LEAF_SLOTS];
+  };
+
+  // keys[i] is the smallest price under children[i + 1]
+  struct Inner {
+    uint32_t count = 0; // children
+    Price keys[INNER_SLOTS - 1];
+    void* children[INNER_SLOTS];
+  };
+
+  template<typename T> static T* _new() { return new (ArenaAllocator<T>().allocate(1)) T(); }
+  template<typename T> static void _delete(T* p) { ArenaAllocator<T>().deallocate(p, 1); }
+
+  static unsigned _childFor(const Inner* inner, Price px) {
+    return std::upper_bound(inner->keys, inner->keys + inner->count - 1, px) - inner->keys;
+  }
+
+  std::pair<LevelNode*, bool> _find(Price px, LevelNode*) {
+    if (root == nullptr) return { nullptr, false };
+    void* at = root;
+    for (unsigned level = 1; level < height; level++) {
+      const Inner* inner = static_cast<const Inner*>(at);
+      at = inner->children[_childFor(inner, px)];
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(at);
+    unsigned i = std::lower_bound(leaf->nodes, leaf->nodes + leaf->count, px, [](const LevelNode* node, Price value) {
+      return node->value.first < value;
+    }) - leaf->nodes;
+    if (i < leaf->count) return { leaf->nodes[i], leaf->nodes[i]->value.first == px };
+    return { nullptr, false }; // insert goes by price, the position is found again on the way down
+  }
+
+  void _insert(LevelNode* node, LevelNode*);
+  void _place(Leaf* leaf, unsigned i, LevelNode* node);
+  template<typename Pred> size_t _eraseIf(Pred pred);
+  void _build(const std::vector<LevelNode*>& sorted);
+  void _clear(bool destroyNodes);
+
+private:
+  void* root = nullptr;
+  unsigned height = 0; // 1 when the root is a leaf
+  Leaf* head = nullptr;
+  Leaf* tail = nullptr;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+void BTreeLevels::_place(Leaf* leaf, unsigned i, LevelNode* node) {
+  for (unsigned j = leaf->count; j > i; j--) {
+    leaf->nodes[j] = leaf->nodes[j - 1];
+    leaf->nodes[j]->slot = j;
+  }
+  leaf->nodes[i] = node;
+  node->slot = i;
+  node->leaf = leaf;
+  leaf->count++;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void BTreeLevels::_insert(LevelNode* node, LevelNode*) {
+  Price px = node->value.first;
+  if (root == nullptr) {
+    Leaf* leaf = _new<Leaf>();
+    _place(leaf, 0, node);
+    root = head = tail = leaf;
+    height = 1;
+    return;
+  }
+
+  Inner* path[MAX_HEIGHT];
+  unsigned childAt[MAX_HEIGHT];
+  void* at = root;
+  for (unsigned level = 0; level + 1 < height; level++) {
+    path[level] = static_cast<Inner*>(at);
+    childAt[level] = _childFor(path[level], px);
+    at = path[level]->children[childAt[level]];
+  }
+
+  Leaf* leaf = static_cast<Leaf*>(at);
+  unsigned i = std::lower_bound(leaf->nodes, leaf->nodes + leaf->count, px, [](const LevelNode* n, Price value) {
+    return n->value.first < value;
+  }) - leaf->nodes;
+  if (leaf->count < LEAF_SLOTS) {
+    _place(leaf, i, node);
+    return;
+  }
+
+  // Split the leaf in half and push the new right leaf's first price up, splitting inner nodes as they fill
+  Leaf* right = _new<Leaf>();
+  unsigned half = LEAF_SLOTS / 2;
+  for (unsigned j = half; j < LEAF_SLOTS; j++) {
+    right->nodes[j - half] = leaf->nodes[j];
+    right->nodes[j - half]->slot = j - half;
+    right->nodes[j - half]->leaf = right;
+  }
+  right->count = LEAF_SLOTS - half;
+  leaf->count = half;
+  right->next = leaf->next;
+  right->prev = leaf;
+  (leaf->next != nullptr ? leaf->next->prev : tail) = right;
+  leaf->next = right;
+  if (i <= half) {
+    _place(leaf, i, node);
+  } else {
+    _place(right, i - half, node);
+  }
+
+  Price key = right->nodes[0]->value.first;
+  void* child = right;
+  for (unsigned level = height - 1; level-- > 0;) {
+    Inner* inner = path[level];
+    unsigned c = childAt[level];
+    if (inner->count < INNER_SLOTS) {
+      for (unsigned j = inner->count; j > c + 1; j--) {
+        inner->children[j] = inner->children[j - 1];
+        inner->keys[j - 1] = inner->keys[j - 2];
+      }
+      inner->children[c + 1] = child;
+      inner->keys[c] = key;
+      inner->count++;
+      return;
+    }
+
+    // Full: lay out the INNER_SLOTS + 1 children and their keys, then split them across two nodes
+    void* children[INNER_SLOTS + 1];
+    Price keys[INNER_SLOTS];
+    for (unsigned j = 0, k = 0; j <= INNER_SLOTS; j++) {
+      if (j == c + 1) {
+        children[j] = child;
+        continue;
+      }
+      children[j] = inner->children[k++];
+    }
+    for (unsigned j = 0, k = 0; j < INNER_SLOTS; j++) {
+      if (j == c) {
+        keys[j] = key;
+        continue;
+      }
+      keys[j] = inner->keys[k++];
+    }
+
+    Inner* sibling = _new<Inner>();
+    unsigned leftCount = (INNER_SLOTS + 1) / 2;
+    inner->count = leftCount;
+    sibling->count = INNER_SLOTS + 1 - leftCount;
+    for (unsigned j = 0; j < leftCount; j++) inner->children[j] = children[j];
+    for (unsigned j = 0; j + 1 < leftCount; j++) inner->keys[j] = keys[j];
+    for (unsigned j = 0; j < sibling->count; j++) sibling->children[j] = children[leftCount + j];
+    for (unsigned j = 0; j + 1 < sibling->count; j++) sibling->keys[j] = keys[leftCount + j];
+    key = keys[leftCount - 1];
+    child = sibling;
+  }
+
+  Inner* newRoot = _new<Inner>();
+  newRoot->count = 2;
+  newRoot->children[0] = root;
+  newRoot->children[1] = child;
+  newRoot->keys[0] = key;
+  root = newRoot;
+  height++;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Pred>
+size_t BTreeLevels::_eraseIf(Pred pred) {
+  std::vector<LevelNode*> kept;
+  kept.reserve(levels);
+  size_t erased = 0;
+  for (Leaf* leaf = head; leaf != nullptr; leaf = leaf->next) {
+    for (unsigned i = 0; i < leaf->count; i++) {
+      if (pred(leaf->nodes[i])) {
+        LevelNode::destroy(leaf->nodes[i]);
+        erased++;
+      } else {
+        kept.push_back(leaf->nodes[i]);
+      }
+    }
+  }
+  _clear(false);
+  _build(kept);
+  return erased;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Bulk load leaves three quarters full, leaving room for the levels that arrive next, then stack inner nodes on them
+//----------------------------------------------------------------------------------------------------------------------
+void BTreeLevels::_build(const std::vector<LevelNode*>& sorted) {
+  if (sorted.empty()) return;
+
+  const unsigned LEAF_FILL = LEAF_SLOTS * 3 / 4;
+  std::vector<std::pair<Price, void*>> row; // smallest price under each node of the row being built
+  for (size_t i = 0; i < sorted.size(); i += LEAF_FILL) {
+    Leaf* leaf = _new<Leaf>();
+    for (size_t j = i; j < std::min(sorted.size(), i + LEAF_FILL); j++) _place(leaf, leaf->count, sorted[j]);
+    leaf->prev = tail;
+    (tail != nullptr ? tail->next : head) = leaf;
+    tail = leaf;
+    row.emplace_back(leaf->nodes[0]->value.first, leaf);
+  }
+  height = 1;
+
+  // Children spread evenly over the fewest inner nodes, so none is left with a single child
+  while (row.size() > 1) {
+    std::vector<std::pair<Price, void*>> above;
+    size_t nodes = (row.size() + INNER_SLOTS - 1) / INNER_SLOTS;
+    for (size_t n = 0, i = 0; n < nodes; n++) {
+      size_t end = i + row.size() / nodes + (n < row.size() % nodes ? 1 : 0);
+      Inner* inner = _new<Inner>();
+      above.emplace_back(row[i].first, inner);
+      for (; i < end; i++) {
+        if (inner->count > 0) inner->keys[inner->count - 1] = row[i].first;
+        inner->children[inner->count++] = row[i].second;
+      }
+    }
+    row.swap(above);
+    height++;
+  }
+  root = row[0].second;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void BTreeLevels::_clear(bool destroyNodes) {
+  if (root == nullptr) return;
+
+  // Inner nodes level by level, then the leaves through their links
+  std::vector<void*> row = { root };
+  for (unsigned level = 1; level < height; level++) {
+    std::vector<void*> below;
+    for (void* p : row) {
+      Inner* inner = static_cast<Inner*>(p);
+      below.insert(below.end(), inner->children, inner->children + inner->count);
+      _delete(inner);
+    }
+    row.swap(below);
+  }
+  for (Leaf* leaf = head; leaf != nullptr;) {
+    Leaf* next = leaf->next;
+    if (destroyNodes) for (unsigned i = 0; i < leaf->count; i++) LevelNode::destroy(leaf->nodes[i]);
+    _delete(leaf);
+    leaf = next;
+  }
+  root = nullptr;
+  head = tail = nullptr;
+  height = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Dense ladder over a band of prices on a grid of Tick 1e-5 ticks (1000 is a cent). The band is a power of two slots
+// that grows, doubling, to take in new prices up to MAX_SLOTS; an occupancy bitmap finds the next level in a word scan.
+// Prices off the grid or beyond the band live in an ordered overflow, and stepping takes whichever of the ladder's and
+// the overflow's next level is nearer, so the order seen through the iterators is the plain price order.
+//----------------------------------------------------------------------------------------------------------------------
+template<int64_t Tick=1000>
+class LadderLevels : public LevelContainer<LadderLevels<Tick>> {
+public:
+  LadderLevels() = default;
+  ~LadderLevels() {
+    for (LevelNode* node : slots) if (node != nullptr) LevelNode::destroy(node);
+    for (auto& [px, node] : overflow) LevelNode::destroy(node);
+  }
+
+  LevelNode* first() const { return _nearer(_ladderAfter(-1), overflow.empty() ? nullptr : overflow.begin()->second); }
+  LevelNode* last() const {
+    return _nearerBelow(_ladderBefore(slots.size()), overflow.empty() ? nullptr : overflow.rbegin()->second);
+  }
+
+  LevelNode* next(LevelNode* node) const {
+    Price px = node->value.first;
+    auto above = overflow.upper_bound(px);
+    LevelNode* fromLadder = _ladderAfter(node->slot != OFF_LADDER ? node->slot - base : _slotBelow(px));
+    return _nearer(fromLadder, above != overflow.end() ? above->second : nullptr);
+  }
+
+  LevelNode* prev(LevelNode* node) const {
+    if (node == nullptr) return last();
+    Price px = node->value.first;
+    auto below = overflow.lower_bound(px);
+    LevelNode* fromOverflow = below != overflow.begin() ? std::prev(below)->second : nullptr;
+    int64_t from = node->slot != OFF_LADDER ? node->slot - base : _slotBelow(px) + (_onSlot(px) ? 0 : 1);
+    return _nearerBelow(_ladderBefore(from), fromOverflow);
+  }
+
+private:
+  friend class LevelContainer<LadderLevels<Tick>>;
+
+  static constexpr int64_t OFF_LADDER = std::numeric_limits<int64_t>::min();
+  static constexpr int64_t INITIAL_SLOTS = 1024;
+  static constexpr int64_t MAX_SLOTS = int64_t(1) << 20;
+
+  static int64_t _ticks(Price px) { return std::llround(px * 1e5); }
+
+  // Absolute slot of a price on the grid, or OFF_LADDER
+  static int64_t _gridSlot(Price px) {
+    int64_t ticks = _ticks(px);
+    if (ticks % Tick != 0 || static_cast<Price>(ticks) / 1e5 != px) return OFF_LADDER;
+    return ticks / Tick;
+  }
+
+  // Band relative index of the highest slot at or below px; may fall outside the band
+  int64_t _slotBelow(Price px) const {
+    int64_t ticks = _ticks(px);
+    int64_t slot = ticks / Tick - (ticks % Tick < 0 ? 1 : 0);
+    if (static_cast<Price>(slot * Tick) / 1e5 > px) slot--;
+    return slot - base;
+  }
+
+  bool _onSlot(Price px) const { return _gridSlot(px) != OFF_LADDER; }
+
+  // First occupied band index above i / last below i
+  LevelNode* _ladderAfter(int64_t i) const {
+    int64_t size = slots.size();
+    i = std::max<int64_t>(i + 1, 0);
+    if (i >= size) return nullptr;
+    size_t word = i >> 6;
+    uint64_t bits = occupied[word] & (~uint64_t(0) << (i & 63));
+    while (bits == 0) {
+      if (++word == occupied.size()) return nullptr;
+      bits = occupied[word];
+    }
+    return slots[(word << 6) + __builtin_ctzll(bits)];
+  }
+
+  LevelNode* _ladderBefore(int64_t i) const {
+    i = std::min<int64_t>(i, slots.size()) - 1;
+    if (i < 0) return nullptr;
+    size_t word = i >> 6;
+    uint64_t bits = occupied[word] & (~uint64_t(0) >> (63 - (i & 63)));
+    while (bits == 0) {
+      if (word-- == 0) return nullptr;
+      bits = occupied[word];
+    }
+    return slots[(word << 6) + 63 - __builtin_clzll(bits)];
+  }
+
+  static LevelNode* _nearer(LevelNode* a, LevelNode* b) {
+    if (a == nullptr) return b;
+    if (b == nullptr) return a;
+    return a->value.first < b->value.first ? a : b;
+  }
+
+  static LevelNode* _nearerBelow(LevelNode* a, LevelNode* b) {
+    if (a == nullptr) return b;
+    if (b == nullptr) return a;
+    return a->value.first > b->value.first ? a : b;
+  }
+
+  std::pair<LevelNode*, bool> _find(Price px, LevelNode*) {
+    int64_t slot = _gridSlot(px);
+    if (slot != OFF_LADDER && slot - base >= 0 && slot - base < static_cast<int64_t>(slots.size())) {
+      LevelNode* node = slots[slot - base];
+      return { node, node != nullptr };
+    }
+    auto it = overflow.find(px);
+    return { it != overflow.end() ? it->second : nullptr, it != overflow.end() };
+  }
+
+  void _insert(LevelNode* node, LevelNode*) {
+    int64_t slot = _gridSlot(node->value.first);
+    if (slot != OFF_LADDER && _cover(slot)) {
+      _occupy(node, slot);
+    } else {
+      node->slot = OFF_LADDER;
+      overflow.emplace(node->value.first, node);
+    }
+  }
+
+  void _occupy(LevelNode* node, int64_t slot) {
+    int64_t i = slot - base;
+    node->slot = slot;
+    slots[i] = node;
+    occupied[i >> 6] |= uint64_t(1) << (i & 63);
+  }
+
+  // Grow the band to take in `slot` if that keeps it within MAX_SLOTS, pulling in overflow levels it now covers
+  bool _cover(int64_t slot) {
+    int64_t size = slots.size();
+    if (size != 0 && slot >= base && slot < base + size) return true;
+
+    int64_t low = size == 0 ? slot - INITIAL_SLOTS / 2 : std::min(base, slot);
+    int64_t high = size == 0 ? slot + INITIAL_SLOTS / 2 : std::max(base + size, slot + 1);
+    int64_t newSize = std::max<int64_t>(size, INITIAL_SLOTS);
+    while (newSize < high - low) newSize *= 2;
+    if (newSize > MAX_SLOTS) return false;
+    // Grow away from the side the new price is on too, so a drifting market doesn't regrow at every step
+    int64_t newBase = slot < base || size == 0 ? high - newSize : low;
+
+    std::vector<LevelNode*> newSlots(newSize, nullptr);
+    std::vector<uint64_t> newOccupied((newSize + 63) / 64, 0);
+    for (int64_t i = 0; i < size; i++) if (slots[i] != nullptr) newSlots[base + i - newBase] = slots[i];
+    slots.swap(newSlots);
+    occupied.swap(newOccupied);
+    base = newBase;
+    for (int64_t i = 0; i < newSize; i++) {
+      if (slots[i] != nullptr) occupied[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+
+    for (auto it = overflow.begin(); it != overflow.end();) {
+      int64_t s = _gridSlot(it->first);
+      if (s != OFF_LADDER && s >= base && s < base + newSize) {
+        _occupy(it->second, s);
+        it = overflow.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return true;
+  }
+
+  template<typename Pred> size_t _eraseIf(Pred pred) {
+    size_t erased = 0;
+    for (size_t i = 0; i < slots.size(); i++) {
+      if (slots[i] != nullptr && pred(slots[i])) {
+        LevelNode::destroy(slots[i]);
+        slots[i] = nullptr;
+        occupied[i >> 6] &= ~(uint64_t(1) << (i & 63));
+        erased++;
+      }
+    }
+    erased += std::erase_if(overflow, [&](const std::pair<const Price, LevelNode*>& entry) {
+      if (!pred(entry.second)) return false;
+      LevelNode::destroy(entry.second);
+      return true;
+    });
+    return erased;
+  }
+
+private:
+  std::vector<LevelNode*> slots; // band index = absolute slot - base
+  std::vector<uint64_t> occupied;
+  int64_t base = 0;
+  std::map<Price, LevelNode*, std::less<Price>, ArenaAllocator<std::pair<const Price, LevelNode*>>> overflow;
+};
+
+const char* const LEVELS_NAMES[] = { "map", "flat", "btree", "ladder" };
+
+bool parseLevelsKind(const std::string& name, LevelsKind& kind) {
+  for (size_t i = 0; i < std::size(LEVELS_NAMES); i++) {
+    if (name == LEVELS_NAMES[i]) {
+      kind = static_cast<LevelsKind>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Default constructed containers, except that FlatLevels orders each side with its best price at the back
+template<typename Levels>
+Levels makeLevels(Side side) {
+  if constexpr (std::is_constructible_v<Levels, Side>) {
+    return Levels(side);
+  } else {
+    return Levels();
+  }
+}
+
+// Per-symbol book state is split in two. The hot header holds what every action for the symbol reads (top of book and
+// counters) and lives in one dense array indexed by SymbolId, so the thousands of quiet symbols cost one small entry
+// each rather than evicting the active ones. The cold part holds the full depth and statistics, allocated separately.
+typedef std::unordered_map<Symbol, SymbolId> SymbolIds;
+
+//
+// Levels that empty out (fills, cancels) stay allocated and keep their level node, so a price that flickers in and out
+// of the book costs no allocation or rebalancing. They are erased in bulk once they outnumber the live levels of their
+// side (see SimpleCross::_reclaimLevels), and everything that walks levels skips them.
+//
+// An empty side's best price is an infinite sentinel, so whether an order crosses is one comparison.
+//
+// hash is the XOR of a key per resting order over its fields and a key per pair of orders queued one behind the other
+// (see SimpleCross::_orderKey). The links fix each queue's order, so equal hashes mean equal contents and time
+// priority, and every change to the book is a few keys out and in.
+template<typename PriceLevels>
+struct BookHot {
+  Price bestBid = -std::numeric_limits<Price>::infinity();
+  Price bestAsk = std::numeric_limits<Price>::infinity();
+  typename PriceLevels::iterator bestBidLevel; // valid while bidLevels != 0
+  typename PriceLevels::iterator bestAskLevel; // valid while askLevels != 0
+  uint32_t bidLevels = 0;             // live (non-empty) levels
+  uint32_t askLevels = 0;
+  uint32_t orders = 0;
+  uint64_t hash = 0;
+  uint64_t seed = 0;                  // the symbol's keys start here, so books of different symbols never cancel
+};
+
+// Book hash keys. The splitmix64 finalizer stands in for a Zobrist table over fields too wide to tabulate.
+struct BookHash {
+  static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  static uint64_t seed(const Symbol& symbol) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : symbol) hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    return mix(hash);
+  }
+};
+
+struct SymbolStats {
+  uint64_t crosses = 0;
+  uint64_t fills = 0;
+  uint64_t filledQty = 0;
+  uint64_t levelsCreated = 0;
+  uint64_t levelsReused = 0;
+  uint64_t levelsReclaimed = 0;
+};
+
+// Log-linear histogram of nanosecond latencies: 8 linear buckets per power of two, so any percentile it reports is the
+// upper bound of a bucket at most 12.5% wider than the true value. Recording is one increment.
+class LatencyHistogram {
+public:
+  static constexpr unsigned SUB_BITS = 3;
+  static constexpr unsigned SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  void record(uint64_t ns) {
+    counts[_bucket(ns)]++;
+    total++;
+    max = std::max(max, ns);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+    total += other.total;
+    max = std::max(max, other.max);
+  }
+
+  uint64_t percentile(double p) const {
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank && seen > 0) return std::min(_upperBound(i), max);
+    }
+    return 0;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t maximum() const { return max; }
+
+private:
+  static size_t _bucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return ns;
+    unsigned msb = 63 - __builtin_clzll(ns);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+  }
+
+  static uint64_t _upperBound(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    unsigned msb = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (msb - SUB_BITS)) - 1;
+  }
+
+private:
+  uint64_t counts[BUCKETS] = {};
+  uint64_t total = 0;
+  uint64_t max = 0;
+};
+
+// Engine wide counters: plain integers owned by the thread driving the engine, bumped outside the matching paths.
+// Everything derivable from the books (fills, live orders and levels, pool and index load) is summed when queried
+struct EngineStats {
+  uint64_t places = 0;
+  uint64_t cancels = 0;
+  uint64_t prints = 0;
+  uint64_t queries = 0;
+  uint64_t positions = 0;
+  uint64_t quotes = 0;
+  uint64_t bulks = 0;
+  uint64_t hashes = 0;
+  uint64_t hashMismatches = 0; // snapshot book hashes that did not match the restored book
+  uint64_t checkpoints = 0;
+  uint64_t checkpointMismatches = 0; // replication checkpoints whose hash did not match the standby's books
+  uint64_t rejects[static_cast<size_t>(RejectReason::COUNT)] = {};
+  LatencyHistogram latency; // action() entry to return
+  LatencyHistogram lag; // standby only: primary receive to standby apply
+
+  void merge(const EngineStats& other) {
+    places += other.places;
+    cancels += other.cancels;
+    prints += other.prints;
+    queries += other.queries;
+    positions += other.positions;
+    quotes += other.quotes;
+    bulks += other.bulks;
+    hashes += other.hashes;
+    hashMismatches += other.hashMismatches;
+    checkpoints += other.checkpoints;
+    checkpointMismatches += other.checkpointMismatches;
+    for (size_t i = 0; i < std::size(rejects); i++) rejects[i] += other.rejects[i];
+    latency.merge(other.latency);
+    lag.merge(other.lag);
+  }
+};
+
+// A market maker's resting quote orders in one symbol, 0 for a side with nothing resting
+struct QuoteOrders { OrderId bid = 0; OrderId ask = 0; };
+
+template<typename PriceLevels>
+struct BookCold {
+  Symbol symbol;
+  PriceLevels bids = makeLevels<PriceLevels>(Side::BUY);
+  PriceLevels asks = makeLevels<PriceLevels>(Side::SELL);
+  uint32_t emptyBidLevels = 0; // allocated levels awaiting reclaim
+  uint32_t emptyAskLevels = 0;
+  std::unordered_map<uint32_t, QuoteOrders> quotes; // by market maker
+  SymbolStats stats;
+};
+
+struct Fill { OrderId oid; Symbol symbol; Quantity qty; Price px; };
+
+// Engine sequence number and nanosecond timestamp. Every inbound action and every outbound event takes the next
+// sequence number, so a gap in either stream is detectable and event.ns - action.ns is the engine latency.
+struct Stamp { uint64_t seq = 0; uint64_t ns = 0; };
+
+// The rest of a QUOTE action, whose bid is the record's order. Sides with qty 0 carry px 0.
+struct QuoteFields { uint32_t pid = 0; OrderId askOid = 0; Quantity askQty = 0; Price askPx = 0; };
+
+// A parsed inbound action. CANCEL and QUEUE only use order.oid, HASH order.symbol, PRINT and STATS nothing. HASH
+// records read from a snapshot carry the book hash to check in hash.
+struct ActionRecord { Action action; Order order; Stamp stamp; QuoteFields quote; uint64_t hash = 0; };
+
+// Outbound event in the binary event log, native (little endian) layout. type is the text result type (F, X, P, E, S,
+// Q, H); side is only set for P and Q, qty and px only for F, P and Q. Q carries no position, that is text only, and H
+// carries its hash in pxTicks.
+struct EventRecord {
+  uint64_t seq;
+  uint64_t ns;
+  uint64_t actionSeq; // inbound action this event answers
+  int64_t pxTicks;    // 1e-5 ticks
+  OrderId oid;
+  Quantity qty;
+  char type;
+  char side;
+  char symbol[8];
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Clock
+//
+// Nanosecond wall clock read from the TSC: rdtsc, a subtract, and a 32.32 fixed point multiply against a reference
+// taken at startup. Calibrated once per process against CLOCK_REALTIME over a few milliseconds, which assumes an
+// invariant TSC (any x86 from the last decade). Other architectures read clock_gettime.
+//----------------------------------------------------------------------------------------------------------------------
+class TscClock {
+public:
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    const TscClock& clock = instance();
+    return clock.baseNs + static_cast<uint64_t>((static_cast<unsigned __int128>(__rdtsc() - clock.baseTsc)
+      * clock.nsPerTick) >> 32);
+#else
+    return _realtimeNs();
+#endif
+  }
+
+private:
+  TscClock();
+  static const TscClock& instance() { static const TscClock clock; return clock; }
+
+  static uint64_t _realtimeNs() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+  }
+
+private:
+  uint64_t baseTsc = 0;
+  uint64_t baseNs = 0;
+  uint64_t nsPerTick = 0; // 32.32 fixed point
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+TscClock::TscClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  const uint64_t CALIBRATION_NS = 10000000;
+
+  uint64_t startNs = _realtimeNs();
+  uint64_t startTsc = __rdtsc();
+  uint64_t endNs;
+  do { endNs = _realtimeNs(); } while (endNs - startNs < CALIBRATION_NS);
+  uint64_t endTsc = __rdtsc();
+
+  nsPerTick = ((endNs - startNs) << 32) / std::max<uint64_t>(endTsc - startTsc, 1);
+  baseTsc = endTsc;
+  baseNs = endNs;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Journal
+//
+// Compact binary encoding for persisted actions and book snapshots. Records are grouped into self contained blocks so a
+// reader can resume at any block boundary, and a torn tail block is detected by its checksum:
+//
+//   BLOCK  := MAGIC(u32) KIND(u8) FLAGS(u8) RESERVED(u8[2]) RECORDS(u32) PAYLOAD_BYTES(u32) CHECKSUM(u32) PAYLOAD
+//   RECORD := TAG(u8) [SEQ_DELTA NS_DELTA] [OID_DELTA [(SYMBOL_REF | SYMBOL_LEN SYMBOL_BYTES) QTY PX_DELTA [QUOTE]]]
+//   QUOTE  := PID [ASK_OID_DELTA ASK_QTY ASK_PX_DELTA]
+//
+// OIDs are zigzag varint deltas against the previous record, quantities are varints, prices are 1e-5 ticks (7.5 format)
+// delta encoded against the last price seen for the same symbol, and symbols are dictionary coded: the first use of a
+// symbol within a block carries its text, later uses refer to it by index. Blocks flagged STAMPED carry each action's
+// engine sequence number and receive time as deltas against the previous record. All coding state resets at block
+// boundaries. Header fields are written little endian.
+//
+// A quote record is a place of its bid followed by the maker and, in action blocks, the ask. In snapshot blocks it is
+// a resting quote order (either side) and its maker. Snapshot blocks have no use for prints, so there the print tag
+// marks a book hash record: the symbol, coded as above, then the hash of its book as restored so far (u64). In action
+// blocks a print tag flagged CHECKPOINT is a checkpoint instead: the engine wide book hash (u64) once the actions
+// before it are applied, which replication streams carry so a standby can check its books against its primary's.
+//
+// Durability is group commit: a JournalWriter writes a block to its stream once the block reaches blockBytes, or on
+// flush(), and never syncs it. A process that dies loses the actions of its unwritten block, whose results may already
+// have been printed, and only what the kernel has written back survives a power loss. Writers that must not hold
+// records back use one record per block, as replication does.
+//----------------------------------------------------------------------------------------------------------------------
+enum class JournalBlock : uint8_t {
+  ACTIONS = 1,
+  SNAPSHOT = 2,
+};
+
+struct JournalFormat {
+  static constexpr uint32_t MAGIC = 0x314a5853; // "SXJ1"
+  static constexpr size_t HEADER_BYTES = 20;
+  static constexpr size_t DEFAULT_BLOCK_BYTES = 64 * 1024;
+
+  static constexpr uint8_t TAG_PLACE = 0;
+  static constexpr uint8_t TAG_CANCEL = 1;
+  static constexpr uint8_t TAG_PRINT = 2;
+  static constexpr uint8_t TAG_QUOTE = 3;
+  static constexpr uint8_t TAG_TYPE_MASK = 0x03;
+  static constexpr uint8_t TAG_SELL = 0x04;
+  static constexpr uint8_t TAG_NEW_SYMBOL = 0x08;
+  static constexpr uint8_t TAG_CHECKPOINT = 0x10;
+
+  static constexpr uint8_t FLAG_STAMPED = 0x01;
+
+  // Prices below 10^7 (7 digits before the decimal), well inside the int64 tick range
+  static constexpr Price MAX_PX = 1e7;
+
+  static int64_t toTicks(Price px) { return std::llround(px * 1e5); }
+  static Price fromTicks(int64_t ticks) { return static_cast<Price>(ticks) / 1e5; }
+
+  // A price the journal holds exactly: positive, in range and on the 1e-5 grid. Dividing the ticks back out is
+  // correctly rounded, so it gives back px only if px is the double nearest some whole number of ticks.
+  static bool onGrid(Price px) { return px > 0 && px < MAX_PX && fromTicks(toTicks(px)) == px; }
+
+  static void put32(uint8_t* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++) dst[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  static uint32_t get32(const uint8_t* src) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= static_cast<uint32_t>(src[i]) << (8 * i);
+    return value;
+  }
+
+  // FNV-1a, only meant to catch torn or truncated blocks
+  static uint32_t checksum(const uint8_t* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+  }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+class JournalWriter {
+public:
+  JournalWriter(std::ostream& out, JournalBlock kind=JournalBlock::ACTIONS, bool stamped=false,
+                size_t blockBytes=JournalFormat::DEFAULT_BLOCK_BYTES);
+  ~JournalWriter() { flush(); }
+
+  void append(Action action, const Order& order, const Stamp& stamp=Stamp(), const QuoteFields& quote=QuoteFields());
+  // Snapshot blocks only
+  void appendHash(const Symbol& symbol, uint64_t hash);
+  // Action blocks only
+  void appendCheckpoint(uint64_t hash, const Stamp& stamp=Stamp());
+  void flush();
+
+  uint64_t records() const { return totalRecords; }
+  uint64_t bytes() const { return totalBytes; }
+
+private:
+  uint32_t _putSymbol(const Symbol& symbol, size_t tagPos);
+  void _putVarint(uint64_t value);
+  void _putZigzag(int64_t value) {
+    _putVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+  }
+
+private:
+  std::ostream& out;
+  JournalBlock kind;
+  bool stamped;
+  size_t blockBytes;
+
+  // Current block
+  std::vector<uint8_t> payload;
+  uint32_t blockRecords = 0;
+  Stamp prevStamp;
+  OrderId prevOid = 0;
+  std::unordered_map<Symbol, uint32_t> symbolRefs;
+  std::vector<int64_t> prevTicks;
+
+  uint64_t totalRecords = 0;
+  uint64_t totalBytes = 0;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+JournalWriter::JournalWriter(std::ostream& _out, JournalBlock _kind, bool _stamped, size_t _blockBytes)
+  : out(_out)
+  , kind(_kind)
+  , stamped(_stamped)
+  , blockBytes(_blockBytes)
+{
+  // Leave headroom for the record that crosses the block threshold
+  payload.reserve(blockBytes + 64);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void JournalWriter::append(Action action, const Order& order, const Stamp& stamp, const QuoteFields& quote) {
+  uint8_t tag;
+  if (action == Action::PLACE) {
+    tag = JournalFormat::TAG_PLACE;
+  } else if (action == Action::CANCEL) {
+    tag = JournalFormat::TAG_CANCEL;
+  } else if (action == Action::PRINT) {
+    tag = JournalFormat::TAG_PRINT;
+  } else if (action == Action::QUOTE) {
+    tag = JournalFormat::TAG_QUOTE;
+  } else {
+    return;
+  }
+
+  size_t tagPos = payload.size();
+  payload.push_back(tag);
+
+  if (stamped) {
+    _putVarint(stamp.seq - prevStamp.seq);
+    _putZigzag(static_cast<int64_t>(stamp.ns - prevStamp.ns));
+    prevStamp = stamp;
+  }
+
+  if (tag != JournalFormat::TAG_PRINT) {
+    _putZigzag(static_cast<int64_t>(order.oid) - static_cast<int64_t>(prevOid));
+    prevOid = order.oid;
+  }
+
+  if (tag == JournalFormat::TAG_PLACE || tag == JournalFormat::TAG_QUOTE) {
+    if (order.side == Side::SELL) payload[tagPos] |= JournalFormat::TAG_SELL;
+
+    uint32_t ref = _putSymbol(order.symbol, tagPos);
+    _putVarint(order.qty);
+    int64_t ticks = JournalFormat::toTicks(order.px);
+    _putZigzag(ticks - prevTicks[ref]);
+    prevTicks[ref] = ticks;
+
+    if (tag == JournalFormat::TAG_QUOTE) {
+      _putVarint(quote.pid);
+      if (kind == JournalBlock::ACTIONS) {
+        _putZigzag(static_cast<int64_t>(quote.askOid) - static_cast<int64_t>(prevOid));
+        prevOid = quote.askOid;
+        _putVarint(quote.askQty);
+        ticks = JournalFormat::toTicks(quote.askPx);
+        _putZigzag(ticks - prevTicks[ref]);
+        prevTicks[ref] = ticks;
+      }
+    }
+  }
+
+  blockRecords++;
+  totalRecords++;
+  if (payload.size() >= blockBytes) flush();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void JournalWriter::appendHash(const Symbol& symbol, uint64_t hash) {
+  size_t tagPos = payload.size();
+  payload.push_back(JournalFormat::TAG_PRINT);
+  _putSymbol(symbol, tagPos);
+  for (int i = 0; i < 8; i++) payload.push_back(static_cast<uint8_t>(hash >> (8 * i)));
+
+  blockRecords++;
+  totalRecords++;
+  if (payload.size() >= blockBytes) flush();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void JournalWriter::appendCheckpoint(uint64_t hash, const Stamp& stamp) {
+  payload.push_back(JournalFormat::TAG_PRINT | JournalFormat::TAG_CHECKPOINT);
+  if (stamped) {
+    _putVarint(stamp.seq - prevStamp.seq);
+    _putZigzag(static_cast<int64_t>(stamp.ns - prevStamp.ns));
+    prevStamp = stamp;
+  }
+  for (int i = 0; i < 8; i++) payload.push_back(static_cast<uint8_t>(hash >> (8 * i)));
+
+  blockRecords++;
+  totalRecords++;
+  if (payload.size() >= blockBytes) flush();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Dictionary code symbol into the record whose tag is at tagPos, returning its reference
+//----------------------------------------------------------------------------------------------------------------------
+uint32_t JournalWriter::_putSymbol(const Symbol& symbol, size_t tagPos) {
+  auto it = symbolRefs.find(symbol);
+  if (it != symbolRefs.end()) {
+    _putVarint(it->second);
+    return it->second;
+  }
+
+  // New dictionary entry, implicitly numbered in order of appearance
+  uint32_t ref = static_cast<uint32_t>(prevTicks.size());
+  symbolRefs.emplace(symbol, ref);
+  prevTicks.push_back(0);
+
+  size_t len = std::min<size_t>(symbol.size(), UINT8_MAX);
+  payload[tagPos] |= JournalFormat::TAG_NEW_SYMBOL;
+  payload.push_back(static_cast<uint8_t>(len));
+  payload.insert(payload.end(), symbol.begin(), symbol.begin() + len);
+  return ref;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void JournalWriter::flush() {
+  if (blockRecords == 0) return;
+
+  uint8_t header[JournalFormat::HEADER_BYTES] = {};
+  JournalFormat::put32(header, JournalFormat::MAGIC);
+  header[4] = static_cast<uint8_t>(kind);
+  header[5] = stamped ? JournalFormat::FLAG_STAMPED : 0;
+  JournalFormat::put32(header + 8, blockRecords);
+  JournalFormat::put32(header + 12, static_cast<uint32_t>(payload.size()));
+  JournalFormat::put32(header + 16, JournalFormat::checksum(payload.data(), payload.size()));
+
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+  out.flush();
+  totalBytes += sizeof(header) + payload.size();
+
+  payload.clear();
+  blockRecords = 0;
+  prevStamp = Stamp();
+  prevOid = 0;
+  symbolRefs.clear();
+  prevTicks.clear();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void JournalWriter::_putVarint(uint64_t value) {
+  while (value >= 0x80) {
+    payload.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  payload.push_back(static_cast<uint8_t>(value));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+class JournalReader {
+public:
+  explicit JournalReader(std::istream& _in) : in(_in) {}
+
+  // Decode the next record. Returns false at end of input or at the first torn/corrupt block (see corrupt())
+  bool next(ActionRecord& record);
+
+  JournalBlock kind() const { return blockKind; }
+  bool corrupt() const { return corrupted; }
+
+private:
+  bool _loadBlock();
+  bool _getSymbol(uint8_t tag, uint64_t& ref);
+  bool _getVarint(uint64_t& value);
+  bool _getZigzag(int64_t& value) {
+    uint64_t raw;
+    if (!_getVarint(raw)) return false;
+    value = static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+    return true;
+  }
+
+private:
+  std::istream& in;
+  bool corrupted = false;
+
+  // Current block
+  JournalBlock blockKind = JournalBlock::ACTIONS;
+  bool blockStamped = false;
+  Stamp prevStamp;
+  std::vector<uint8_t> payload;
+  size_t pos = 0;
+  uint32_t blockRecords = 0;
+  uint32_t recordsRead = 0;
+  OrderId prevOid = 0;
+  std::vector<Symbol> symbols;
+  std::vector<int64_t> prevTicks;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+bool JournalReader::next(ActionRecord& record) {
+  while (recordsRead == blockRecords) {
+    if (!_loadBlock()) return false;
+  }
+
+  if (pos >= payload.size()) { corrupted = true; return false; }
+  uint8_t tag = payload[pos++];
+  uint8_t type = tag & JournalFormat::TAG_TYPE_MASK;
+
+  record.order = Order();
+  record.stamp = Stamp();
+  record.quote = QuoteFields();
+  record.hash = 0;
+  if (blockStamped) {
+    uint64_t seqDelta;
+    int64_t nsDelta;
+    if (!_getVarint(seqDelta) || !_getZigzag(nsDelta)) { corrupted = true; return false; }
+    prevStamp.seq += seqDelta;
+    prevStamp.ns += nsDelta;
+    record.stamp = prevStamp;
+  }
+
+  if (type == JournalFormat::TAG_PRINT && blockKind == JournalBlock::SNAPSHOT) {
+    uint64_t ref;
+    if (!_getSymbol(tag, ref) || pos + 8 > payload.size()) { corrupted = true; return false; }
+    record.action = Action::HASH;
+    record.order.symbol = symbols[ref];
+    for (int i = 0; i < 8; i++) record.hash |= static_cast<uint64_t>(payload[pos++]) << (8 * i);
+  } else if (type == JournalFormat::TAG_PRINT && (tag & JournalFormat::TAG_CHECKPOINT)) {
+    if (pos + 8 > payload.size()) { corrupted = true; return false; }
+    record.action = Action::HASH;
+    for (int i = 0; i < 8; i++) record.hash |= static_cast<uint64_t>(payload[pos++]) << (8 * i);
+  } else if (type == JournalFormat::TAG_PRINT) {
+    record.action = Action::PRINT;
+  } else {
+    int64_t oidDelta;
+    if (!_getZigzag(oidDelta)) { corrupted = true; return false; }
+    prevOid = static_cast<OrderId>(static_cast<int64_t>(prevOid) + oidDelta);
+    record.order.oid = prevOid;
+    record.action = type == JournalFormat::TAG_PLACE ? Action::PLACE
+      : type == JournalFormat::TAG_QUOTE ? Action::QUOTE : Action::CANCEL;
+  }
+
+  if (type == JournalFormat::TAG_PLACE || type == JournalFormat::TAG_QUOTE) {
+    record.order.side = (tag & JournalFormat::TAG_SELL) ? Side::SELL : Side::BUY;
+
+    uint64_t ref;
+    if (!_getSymbol(tag, ref)) { corrupted = true; return false; }
+    record.order.symbol = symbols[ref];
+
+    uint64_t qty;
+    int64_t pxDelta;
+    if (!_getVarint(qty) || !_getZigzag(pxDelta)) { corrupted = true; return false; }
+    record.order.qty = static_cast<Quantity>(qty);
+    prevTicks[ref] += pxDelta;
+    record.order.px = JournalFormat::fromTicks(prevTicks[ref]);
+
+    if (type == JournalFormat::TAG_QUOTE) {
+      uint64_t pid;
+      if (!_getVarint(pid)) { corrupted = true; return false; }
+      record.quote.pid = static_cast<uint32_t>(pid);
+
+      if (blockKind == JournalBlock::ACTIONS) {
+        int64_t oidDelta;
+        uint64_t askQty;
+        if (!_getZigzag(oidDelta) || !_getVarint(askQty) || !_getZigzag(pxDelta)) { corrupted = true; return false; }
+        prevOid = static_cast<OrderId>(static_cast<int64_t>(prevOid) + oidDelta);
+        record.quote.askOid = prevOid;
+        record.quote.askQty = static_cast<Quantity>(askQty);
+        prevTicks[ref] += pxDelta;
+        record.quote.askPx = JournalFormat::fromTicks(prevTicks[ref]);
+      }
+    }
+  }
+
+  recordsRead++;
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool JournalReader::_getSymbol(uint8_t tag, uint64_t& ref) {
+  if (tag & JournalFormat::TAG_NEW_SYMBOL) {
+    if (pos >= payload.size() || pos + 1 + payload[pos] > payload.size()) return false;
+    size_t len = payload[pos++];
+    ref = symbols.size();
+    symbols.emplace_back(reinterpret_cast<const char*>(&payload[pos]), len);
+    prevTicks.push_back(0);
+    pos += len;
+    return true;
+  }
+  return _getVarint(ref) && ref < symbols.size();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool JournalReader::_loadBlock() {
+  uint8_t header[JournalFormat::HEADER_BYTES];
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+    // A partial header is a torn write, a clean EOF is not
+    if (in.gcount() != 0) corrupted = true;
+    return false;
+  }
+
+  if (JournalFormat::get32(header) != JournalFormat::MAGIC) { corrupted = true; return false; }
+
+  uint32_t records = JournalFormat::get32(header + 8);
+  uint32_t payloadBytes = JournalFormat::get32(header + 12);
+  payload.resize(payloadBytes);
+  if (!in.read(reinterpret_cast<char*>(payload.data()), payloadBytes)
+      || JournalFormat::checksum(payload.data(), payloadBytes) != JournalFormat::get32(header + 16)) {
+    corrupted = true;
+    return false;
+  }
+
+  blockKind = static_cast<JournalBlock>(header[4]);
+  blockStamped = header[5] & JournalFormat::FLAG_STAMPED;
+  prevStamp = Stamp();
+  blockRecords = records;
+  recordsRead = 0;
+  pos = 0;
+  prevOid = 0;
+  symbols.clear();
+  prevTicks.clear();
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool JournalReader::_getVarint(uint64_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= payload.size()) return false;
+    uint8_t byte = payload[pos++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Replication
+//
+// A primary streams the actions it journals to a hot standby over a local (Unix domain) socket, in the journal format:
+// stamped action blocks, one record per block so no action waits on a block filling, with a checkpoint of the
+// primary's book hash every so many actions (see setReplica). The standby applies the stream as it arrives (follow()),
+// checks every checkpoint against its own books and measures how long after the primary received each action it was
+// applied. When the primary goes away the stream ends, and the standby takes over with its books already current.
+//
+// The primary never waits on its standby. Its blocks go into a bounded queue that a sender thread drains onto the
+// socket (see ReplicaSender), and a standby that falls a whole queue behind, or stops reading, is detached: its
+// connection is shut down and the primary carries on without it.
+//----------------------------------------------------------------------------------------------------------------------
+class FdStreamBuf : public std::streambuf {
+public:
+  // Takes ownership of fd
+  explicit FdStreamBuf(int _fd) : fd(_fd) {
+    setg(inBuf, inBuf, inBuf);
+    setp(outBuf, outBuf + sizeof(outBuf));
+  }
+  ~FdStreamBuf() {
+    sync();
+    close(fd);
+  }
+  FdStreamBuf(const FdStreamBuf&) = delete;
+  FdStreamBuf& operator=(const FdStreamBuf&) = delete;
+
+protected:
+  int_type underflow() override;
+  int_type overflow(int_type c) override;
+  int sync() override { return _drain() ? 0 : -1; }
+
+private:
+  bool _drain();
+
+private:
+  int fd;
+  char inBuf[64 * 1024];
+  char outBuf[64 * 1024];
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+FdStreamBuf::int_type FdStreamBuf::underflow() {
+  ssize_t n;
+  do {
+    n = read(fd, inBuf, sizeof(inBuf));
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return traits_type::eof();
+
+  setg(inBuf, inBuf, inBuf + n);
+  return traits_type::to_int_type(inBuf[0]);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+FdStreamBuf::int_type FdStreamBuf::overflow(int_type c) {
+  if (!_drain()) return traits_type::eof();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Write out everything buffered. A vanished peer fails the stream rather than raising SIGPIPE
+//----------------------------------------------------------------------------------------------------------------------
+bool FdStreamBuf::_drain() {
+  for (char* p = pbase(); p < pptr();) {
+    ssize_t n = send(fd, p, pptr() - p, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+  }
+  setp(outBuf, outBuf + sizeof(outBuf));
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+struct LocalSocket {
+  // Listen on path, replacing a stale socket left by an earlier run, and accept a single peer. -1 on failure
+  static int acceptOne(const std::string& path);
+  // Connect to path, retrying for up to timeoutMs while the peer starts listening. -1 on failure
+  static int connect(const std::string& path, int timeoutMs=5000);
+
+  static bool address(const std::string& path, sockaddr_un& addr) {
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+  }
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+int LocalSocket::acceptOne(const std::string& path) {
+  sockaddr_un addr;
+  if (!address(path, addr)) return -1;
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) return -1;
+
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+    close(listener);
+    return -1;
+  }
+
+  int fd;
+  do {
+    fd = accept(listener, nullptr, nullptr);
+  } while (fd < 0 && errno == EINTR);
+  close(listener);
+  unlink(path.c_str());
+  return fd;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+int LocalSocket::connect(const std::string& path, int timeoutMs) {
+  sockaddr_un addr;
+  if (!address(path, addr)) return -1;
+
+  for (int waited = 0;; waited += 10) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) return fd;
+    close(fd);
+    if (waited >= timeoutMs) return -1;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Output stream buffer for the primary's end of the replication socket. Each flush of the stream (a journal block)
+// goes whole into a byte ring, or, if the ring can't take it, detaches the standby and fails the stream. The sender
+// thread, owned by this buffer, writes the ring out with blocking sends until finish() (or destruction) and the ring
+// is drained, or the standby goes away.
+//----------------------------------------------------------------------------------------------------------------------
+class ReplicaSender : public std::streambuf {
+public:
+  static constexpr size_t QUEUE_BYTES = 16 << 20;
+
+  // Takes ownership of fd
+  explicit ReplicaSender(int fd);
+  ~ReplicaSender();
+  ReplicaSender(const ReplicaSender&) = delete;
+  ReplicaSender& operator=(const ReplicaSender&) = delete;
+
+  // The queue overflowed or the standby went away, nothing more is forwarded
+  bool detached() const { return failed.load(std::memory_order_acquire); }
+  // Engine thread, once it is done: send what is queued and stop the sender. False if the standby was detached
+  bool finish();
+
+protected:
+  int_type overflow(int_type c) override;
+  int sync() override { return _push() ? 0 : -1; }
+
+private:
+  bool _push();
+  void _run();
+
+private:
+  int fd;
+  char outBuf[64 * 1024];
+  std::vector<char> ring;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head{0}; // next byte to send, written by the sender
+  alignas(64) std::atomic<uint64_t> tail{0}; // next byte to queue, written by the engine thread
+  std::atomic<bool> finished{false};
+  std::atomic<bool> failed{false};
+  std::thread sender;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+ReplicaSender::ReplicaSender(int _fd) : fd(_fd), ring(QUEUE_BYTES), mask(QUEUE_BYTES - 1) {
+  static_assert((QUEUE_BYTES & (QUEUE_BYTES - 1)) == 0, "the ring wraps with a mask");
+  setp(outBuf, outBuf + sizeof(outBuf));
+  sender = std::thread([this]() { _run(); });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+ReplicaSender::~ReplicaSender() {
+  finish();
+  close(fd);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool ReplicaSender::finish() {
+  if (sender.joinable()) {
+    _push();
+    finished.store(true, std::memory_order_release);
+    sender.join();
+  }
+  return !detached();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+ReplicaSender::int_type ReplicaSender::overflow(int_type c) {
+  if (!_push()) return traits_type::eof();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Engine thread: queue everything buffered, or detach if it doesn't fit
+//----------------------------------------------------------------------------------------------------------------------
+bool ReplicaSender::_push() {
+  size_t bytes = pptr() - pbase();
+  setp(outBuf, outBuf + sizeof(outBuf));
+  if (failed.load(std::memory_order_relaxed)) return false;
+  if (bytes == 0) return true;
+
+  uint64_t t = tail.load(std::memory_order_relaxed);
+  if (ring.size() - (t - head.load(std::memory_order_acquire)) < bytes) {
+    // Also wakes a sender blocked on the stalled peer
+    failed.store(true, std::memory_order_release);
+    shutdown(fd, SHUT_RDWR);
+    return false;
+  }
+  size_t first = std::min(bytes, ring.size() - (t & mask));
+  std::memcpy(&ring[t & mask], outBuf, first);
+  std::memcpy(&ring[0], outBuf + first, bytes - first);
+  tail.store(t + bytes, std::memory_order_release);
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sender thread. A vanished peer fails the stream rather than raising SIGPIPE
+//----------------------------------------------------------------------------------------------------------------------
+void ReplicaSender::_run() {
+  for (;;) {
+    // Checked before looking at the ring, so everything queued before the end is sent on the way out
+    bool last = finished.load(std::memory_order_acquire);
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t t = tail.load(std::memory_order_acquire);
+    if (h == t) {
+      if (last || failed.load(std::memory_order_acquire)) break;
+      std::this_thread::yield();
+      continue;
+    }
+
+    size_t bytes = std::min<uint64_t>(t - h, ring.size() - (h & mask));
+    ssize_t n = send(fd, &ring[h & mask], bytes, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      failed.store(true, std::memory_order_release);
+      break;
+    }
+    head.store(h + n, std::memory_order_release);
+  }
+  shutdown(fd, SHUT_WR);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Book Image
+//
+// A file backed copy of every resting order, mapped into the engine and kept current as the books change, so a
+// restarted engine re-attaches to its books instead of replaying a journal. The image mirrors the OrderPool slot for
+// slot: an order's handle is its index in the image and the FIFO links between orders are handles too, so nothing in
+// the file is an address and it maps anywhere. Chunks of slots, symbol names and undo records are carved off the end
+// of the file as they are needed and found through offset tables in the header, so growing never moves anything and
+// the mapping (one reservation of MAX_BYTES, with the file growing into it) never moves either. Levels and the OID
+// index are not stored: a level is the chain of orders from a head slot (prev NO_ORDER), and attachImage() rebuilds
+// both in the engine's own containers with one pass over the resting orders.
+//
+// Updates survive the process dying at any point. Every slot write is preceded by an undo record holding the slot as
+// it was, and commit() makes an action's writes final with a single store of the commit counter, which also selects
+// between two copies of the last action's sequence numbers and book hash. open() finds an image whose undo records
+// belong to a commit that never happened torn and writes them back newest first, leaving the image as of its last
+// committed action; the journal records after that are replayed as usual. Stores only have to stay in program order
+// for this, whatever the process stored is in the page cache when it dies. A power loss is another matter, the kernel
+// writes pages back in any order, so the image is only as durable as the last flush() and otherwise the snapshot and
+// journal are the recovery path.
+//
+//   FILE := HEADER CHUNK...     (native layout; slot, symbol and undo chunks in allocation order)
+//----------------------------------------------------------------------------------------------------------------------
+class BookImage {
+public:
+  static constexpr uint32_t MAGIC = 0x49425853; // "SXBI"
+  static constexpr uint32_t VERSION = 1;
+
+  struct Slot {
+    Price px;
+    OrderId oid;
+    SymbolId symbolId;
+    uint32_t owner;
+    OrderHandle prev;
+    OrderHandle next;
+    Quantity qty;
+    char side;
+    uint8_t resting; // 0 for a free handle
+  };
+  static_assert(sizeof(Slot) == 32, "slots pack two to a cache line");
+
+  BookImage() = default;
+  ~BookImage();
+  BookImage(const BookImage&) = delete;
+  BookImage& operator=(const BookImage&) = delete;
+
+  // Map `path`, creating an empty image if there is no file, and roll back the action a crash left torn. False if the
+  // file is not a book image or can't be mapped
+  bool open(const std::string& path);
+
+  // No action has been committed yet
+  bool empty() const { return header->commits == 0; }
+
+  // The last committed action, the engine's sequence number after it, and its book hash
+  uint64_t actionSeq() const { return _mark().actionSeq; }
+  uint64_t sequence() const { return _mark().sequence; }
+  uint64_t bookHash() const { return _mark().bookHash; }
+  uint64_t rolledBack() const { return rolledBackWrites; }
+
+  // Symbols in SymbolId order, and one past the highest handle ever stored
+  SymbolId symbols() const { return header->symbols; }
+  Symbol symbol(SymbolId symbolId) const;
+  OrderHandle handles() const { return header->handles; }
+  const Slot& slot(OrderHandle handle) const {
+    return reinterpret_cast<const Slot*>(base + header->slotChunks[handle >> SLOT_CHUNK_BITS])[handle & SLOT_MASK];
+  }
+
+  // Every resting slot is on exactly one well formed chain from a head, of orders sharing a symbol, side and price
+  bool consistent() const;
+
+  // Writes, made between commits. Symbols are appended in SymbolId order
+  void addSymbol(const Symbol& symbol);
+  void store(OrderHandle handle, const RestingOrder& order, bool resting=true);
+  void commit(uint64_t actionSeq, uint64_t sequence, uint64_t bookHash);
+
+  // Write dirty pages to the disk, e.g. at a clean shutdown
+  bool flush() { return ::msync(base, header->fileBytes, MS_SYNC) == 0; }
+
+private:
+  static constexpr unsigned SLOT_CHUNK_BITS = 16;   // as the OrderPool's
+  static constexpr unsigned SYMBOL_CHUNK_BITS = 16;
+  static constexpr unsigned UNDO_CHUNK_BITS = 16;
+  static constexpr OrderHandle SLOT_MASK = (1u << SLOT_CHUNK_BITS) - 1;
+  static constexpr SymbolId SYMBOL_MASK = (1u << SYMBOL_CHUNK_BITS) - 1;
+  static constexpr uint64_t UNDO_MASK = (1u << UNDO_CHUNK_BITS) - 1;
+  static constexpr size_t SYMBOL_BYTES = 8;          // the longest valid symbol, unterminated at full length
+  static constexpr size_t MAX_BYTES = size_t(1) << 40;
+  static constexpr size_t PAGE_BYTES = 4096;
+
+  struct Mark { uint64_t actionSeq; uint64_t sequence; uint64_t bookHash; };
+  struct Undo { OrderHandle handle; uint32_t unused; Slot before; };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotBytes;
+    SymbolId symbols;
+    uint64_t fileBytes;  // chunks are allocated from here
+    uint64_t handles;
+    uint64_t commits;    // the commit point: marks[commits & 1] describes the last committed action
+    Mark marks[2];
+    uint64_t undoCommit; // the commit the undo records lead up to, torn if it is commits + 1
+    uint64_t undoRecords;
+    // File offsets, 0 until allocated
+    uint64_t slotChunks[size_t(1) << (32 - SLOT_CHUNK_BITS)];
+    uint64_t symbolChunks[size_t(1) << (32 - SYMBOL_CHUNK_BITS)];
+    uint64_t undoChunks[size_t(1) << (32 - UNDO_CHUNK_BITS)];
+  };
+  static constexpr size_t HEADER_BYTES = (sizeof(Header) + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+
+  // Keeps the compiler from moving stores across it; see the crash model above
+  static void _fence() { std::atomic_signal_fence(std::memory_order_seq_cst); }
+
+  const Mark& _mark() const { return header->marks[header->commits & 1]; }
+  char* _chunk(uint64_t& offset, size_t bytes);
+  Slot* _slot(OrderHandle handle) {
+    return reinterpret_cast<Slot*>(_chunk(header->slotChunks[handle >> SLOT_CHUNK_BITS],
+                                          sizeof(Slot) << SLOT_CHUNK_BITS)) + (handle & SLOT_MASK);
+  }
+  Undo* _undo(uint64_t record) {
+    return reinterpret_cast<Undo*>(_chunk(header->undoChunks[record >> UNDO_CHUNK_BITS],
+                                          sizeof(Undo) << UNDO_CHUNK_BITS)) + (record & UNDO_MASK);
+  }
+  void _rollBack();
+
+private:
+  int fd = -1;
+  char* base = nullptr;
+  Header* header = nullptr;
+  uint64_t rolledBackWrites = 0;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+BookImage::~BookImage() {
+  if (base != nullptr) ::munmap(base, MAX_BYTES);
+  if (fd >= 0) ::close(fd);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool BookImage::open(const std::string& path) {
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat status;
+  if (fd < 0 || ::fstat(fd, &status) != 0) return false;
+
+  // Reserve the largest image up front: the file grows into the reservation, so the mapping never moves
+  void* mapping = ::mmap(nullptr, MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if (mapping == MAP_FAILED) return false;
+  base = static_cast<char*>(mapping);
+  header = reinterpret_cast<Header*>(base);
+
+  // The magic goes in last, so a file that only got as far as its zeroed header is started again
+  if (status.st_size == 0 || (static_cast<size_t>(status.st_size) == HEADER_BYTES && header->magic == 0)) {
+    if (::ftruncate(fd, HEADER_BYTES) != 0) return false;
+    header->version = VERSION;
+    header->slotBytes = sizeof(Slot);
+    header->fileBytes = HEADER_BYTES;
+    _fence();
+    header->magic = MAGIC;
+    return true;
+  }
+
+  if (static_cast<size_t>(status.st_size) < HEADER_BYTES || header->magic != MAGIC || header->version != VERSION
+      || header->slotBytes != sizeof(Slot) || header->fileBytes > static_cast<size_t>(status.st_size)) {
+    return false;
+  }
+
+  if (header->undoCommit == header->commits + 1) _rollBack();
+  // Names added by a first action that never committed, which a restart adds again
+  if (header->commits == 0) header->symbols = 0;
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+Symbol BookImage::symbol(SymbolId symbolId) const {
+  const char* name = base + header->symbolChunks[symbolId >> SYMBOL_CHUNK_BITS]
+    + (symbolId & SYMBOL_MASK) * SYMBOL_BYTES;
+  return Symbol(name, strnlen(name, SYMBOL_BYTES));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool BookImage::consistent() const {
+  uint64_t resting = 0;
+  uint64_t chained = 0;
+  for (OrderHandle handle = 0; handle < handles(); handle++) {
+    const Slot& head = slot(handle);
+    if (!head.resting) continue;
+    resting++;
+    if (head.symbolId >= symbols() || (head.side != Side::BUY && head.side != Side::SELL) || head.qty == 0
+        || !(head.px > 0)) {
+      return false;
+    }
+    if (head.prev != NO_ORDER) continue;
+
+    // Each link is checked from both ends, so a chain can't loop back on itself
+    OrderHandle prev = NO_ORDER;
+    for (OrderHandle at = handle; at != NO_ORDER; prev = at, at = slot(at).next) {
+      if (at >= handles()) return false;
+      const Slot& order = slot(at);
+      if (!order.resting || order.prev != prev || order.symbolId != head.symbolId || order.side != head.side
+          || order.px != head.px) {
+        return false;
+      }
+      chained++;
+    }
+  }
+  return chained == resting;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void BookImage::addSymbol(const Symbol& symbol) {
+  SymbolId symbolId = header->symbols;
+  char* name = _chunk(header->symbolChunks[symbolId >> SYMBOL_CHUNK_BITS], SYMBOL_BYTES << SYMBOL_CHUNK_BITS)
+    + (symbolId & SYMBOL_MASK) * SYMBOL_BYTES;
+  std::memset(name, 0, SYMBOL_BYTES);
+  symbol.copy(name, SYMBOL_BYTES);
+  _fence();
+  header->symbols = symbolId + 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// The first write after a commit starts the next action's undo records. Records are only counted once written, and
+// the slot only changes once its record is counted
+//----------------------------------------------------------------------------------------------------------------------
+void BookImage::store(OrderHandle handle, const RestingOrder& order, bool resting) {
+  if (header->undoCommit != header->commits + 1) {
+    header->undoRecords = 0;
+    _fence();
+    header->undoCommit = header->commits + 1;
+    _fence();
+  }
+
+  Slot* slot = _slot(handle);
+  uint64_t record = header->undoRecords;
+  Undo* undo = _undo(record);
+  undo->handle = handle;
+  undo->before = *slot;
+  _fence();
+  header->undoRecords = record + 1;
+  header->handles = std::max<uint64_t>(header->handles, uint64_t(handle) + 1);
+  _fence();
+
+  *slot = Slot{ order.order.px, order.order.oid, order.symbolId, order.owner, order.prev, order.next, order.order.qty,
+                static_cast<char>(order.order.side), static_cast<uint8_t>(resting) };
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void BookImage::commit(uint64_t actionSeq, uint64_t sequence, uint64_t bookHash) {
+  uint64_t commits = header->commits;
+  header->marks[(commits + 1) & 1] = Mark{ actionSeq, sequence, bookHash };
+  _fence();
+  header->commits = commits + 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// A chunk at the end of the file, zero filled, the first time its table entry is used. A chunk taken by an action that
+// is rolled back stays allocated, unused space rather than a torn table
+//----------------------------------------------------------------------------------------------------------------------
+char* BookImage::_chunk(uint64_t& offset, size_t bytes) {
+  if (offset == 0) [[unlikely]] {
+    uint64_t end = header->fileBytes;
+    if (end + bytes > MAX_BYTES || ::ftruncate(fd, end + bytes) != 0) throw std::bad_alloc();
+    header->fileBytes = end + bytes;
+    _fence();
+    offset = end;
+  }
+  return base + offset;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Newest first, so a slot written more than once ends up as it was before the first write. Rolling back again after a
+// crash in here does the same writes again
+//----------------------------------------------------------------------------------------------------------------------
+void BookImage::_rollBack() {
+  for (uint64_t record = header->undoRecords; record-- > 0;) {
+    const Undo* undo = _undo(record);
+    *_slot(undo->handle) = undo->before;
+  }
+  rolledBackWrites = header->undoRecords;
+  _fence();
+  header->undoCommit = header->commits;
+  header->undoRecords = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Flight Recorder
+//
+// Always on ring of the engine's most recent actions, fills and book decisions, for post-mortem analysis. Recording an
+// event is a handful of stores into a preallocated 32 byte slot; nothing is formatted or flushed on the hot path. The
+// ring is written out by dump(), from a fatal signal handler (see installDumpHandler), or on SIGUSR1, and
+// decodeFlightDump() turns a dump back into text.
+//
+//   DUMP := MAGIC(u32) VERSION(u32) RECORD_BYTES(u32) SYMBOLS(u32) CAPACITY(u64) HEAD(u64)
+//           SYMBOL_NAME(char[16])[SYMBOLS] RECORD[min(HEAD, CAPACITY)]      (records oldest first, native layout)
+//----------------------------------------------------------------------------------------------------------------------
+enum class FlightEvent : uint8_t {
+  ACTION = 1,       // detail: action, qty/px for places
+  REJECT,           // detail: action
+  FILL,             // resting order filled by qty at px, detail: resting side
+  RESTED,           // detail: side
+  CANCELLED,        // detail: side
+  ORDER_PURGED,     // fully filled order removed from the book
+  LEVEL_CREATED,    // detail: side
+  LEVEL_EMPTIED,    // detail: side
+  LEVELS_RECLAIMED, // oid holds the number of levels dropped, detail: side
+  REQUOTED,         // quote order updated in place to oid and qty, detail: side
+};
+
+struct FlightRecord {
+  uint64_t ns;        // receive time of the action being processed
+  Price px;
+  uint32_t seq;       // low 32 bits of the action's sequence number
+  OrderId oid;
+  SymbolId symbolId;
+  Quantity qty;
+  FlightEvent event;
+  char detail;
+};
+static_assert(sizeof(FlightRecord) == 32, "flight records pack two to a cache line");
+
+class FlightRecorder {
+public:
+  static constexpr uint32_t MAGIC = 0x52465853; // "SXFR"
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t DEFAULT_RECORDS = 1 << 16;
+  static constexpr size_t SYMBOL_BYTES = 16;
+  static constexpr SymbolId NO_SYMBOL = UINT32_MAX;
+
+  explicit FlightRecorder(size_t records=DEFAULT_RECORDS);
+  ~FlightRecorder() { std::free(ring); }
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  void record(const Stamp& stamp, FlightEvent event, char detail, OrderId oid, SymbolId symbolId=NO_SYMBOL,
+              Quantity qty=0, Price px=0) {
+    FlightRecord& slot = ring[head & mask];
+    slot.ns = stamp.ns;
+    slot.px = px;
+    slot.seq = static_cast<uint32_t>(stamp.seq);
+    slot.oid = oid;
+    slot.symbolId = symbolId;
+    slot.qty = qty;
+    slot.event = event;
+    slot.detail = detail;
+    head++;
+  }
+
+  // Names are copied (truncated) so a dump never has to touch engine state
+  void nameSymbol(SymbolId symbolId, const Symbol& symbol);
+
+  // Async signal safe. A dump taken while the engine is mid-record may show that one record torn
+  bool dump(int fd) const;
+  bool dump(const char* path) const;
+
+  // Dump `recorder` to `path` on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT (then die as before), and on SIGUSR1
+  static void installDumpHandler(const FlightRecorder* recorder, const std::string& path);
+
+  uint64_t recorded() const { return head; }
+  size_t capacity() const { return mask + 1; }
+
+private:
+  static void _onSignal(int signal);
+
+private:
+  FlightRecord* ring;
+  size_t mask;
+  uint64_t head = 0;
+  std::vector<std::array<char, SYMBOL_BYTES>> symbols;
+
+  static const FlightRecorder* dumpRecorder;
+  static char dumpPath[4096];
+};
+
+const FlightRecorder* FlightRecorder::dumpRecorder = nullptr;
+char FlightRecorder::dumpPath[4096];
+
+//----------------------------------------------------------------------------------------------------------------------
+FlightRecorder::FlightRecorder(size_t records) {
+  size_t capacity = 1;
+  while (capacity < records) capacity <<= 1;
+  // calloc leaves large rings to the kernel's zero pages until they are first written
+  ring = static_cast<FlightRecord*>(std::calloc(capacity, sizeof(FlightRecord)));
+  if (!ring) throw std::bad_alloc();
+  mask = capacity - 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void FlightRecorder::nameSymbol(SymbolId symbolId, const Symbol& symbol) {
+  if (symbols.size() <= symbolId) symbols.resize(symbolId + 1);
+  std::array<char, SYMBOL_BYTES>& name = symbols[symbolId];
+  name.fill(0);
+  symbol.copy(name.data(), SYMBOL_BYTES - 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool FlightRecorder::dump(int fd) const {
+  auto writeAll = [fd](const void* data, size_t bytes) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+      ssize_t written = ::write(fd, p, bytes);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return false;
+      p += written;
+      bytes -= written;
+    }
+    return true;
+  };
+
+  uint64_t end = head;
+  uint64_t capacity = mask + 1;
+  uint64_t count = std::min(end, capacity);
+  uint32_t header[8] = { MAGIC, VERSION, sizeof(FlightRecord), static_cast<uint32_t>(symbols.size()) };
+  std::memcpy(header + 4, &capacity, sizeof(capacity));
+  std::memcpy(header + 6, &end, sizeof(end));
+  if (!writeAll(header, sizeof(header))) return false;
+  if (!symbols.empty() && !writeAll(symbols.data(), symbols.size() * SYMBOL_BYTES)) return false;
+
+  // Oldest first: the tail of the ring from the write position, then its head
+  size_t start = (end - count) & mask;
+  size_t first = std::min<uint64_t>(count, capacity - start);
+  return writeAll(ring + start, first * sizeof(FlightRecord))
+    && writeAll(ring, (count - first) * sizeof(FlightRecord));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool FlightRecorder::dump(const char* path) const {
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool ok = dump(fd);
+  return ::close(fd) == 0 && ok;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void FlightRecorder::installDumpHandler(const FlightRecorder* recorder, const std::string& path) {
+  dumpRecorder = recorder;
+  std::memset(dumpPath, 0, sizeof(dumpPath));
+  path.copy(dumpPath, sizeof(dumpPath) - 1);
+
+  struct sigaction action = {};
+  action.sa_handler = _onSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, nullptr);
+
+  // Fatal signals dump once, then take the default action when re-raised
+  action.sa_flags = SA_RESETHAND;
+  for (int signal : { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT }) sigaction(signal, &action, nullptr);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void FlightRecorder::_onSignal(int signal) {
+  int savedErrno = errno;
+  if (dumpRecorder) dumpRecorder->dump(dumpPath);
+  errno = savedErrno;
+  if (signal != SIGUSR1) raise(signal);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Print a flight recorder dump, one event per line: SEQ NS EVENT DETAIL OID SYMBOL QTY PX
+//----------------------------------------------------------------------------------------------------------------------
+int decodeFlightDump(const std::string& path) {
+  static const char* EVENT_NAMES[] = {
+    "?", "ACTION", "REJECT", "FILL", "RESTED", "CANCELLED", "ORDER_PURGED", "LEVEL_CREATED", "LEVEL_EMPTIED",
+    "LEVELS_RECLAIMED", "REQUOTED"
+  };
+
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  uint32_t header[8];
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))
+      || header[0] != FlightRecorder::MAGIC || header[2] != sizeof(FlightRecord)) {
+    std::cerr << "Not a flight recorder dump: " << path << std::endl;
+    return 1;
+  }
+  uint64_t capacity, head;
+  std::memcpy(&capacity, header + 4, sizeof(capacity));
+  std::memcpy(&head, header + 6, sizeof(head));
+
+  std::vector<std::array<char, FlightRecorder::SYMBOL_BYTES>> symbols(header[3]);
+  in.read(reinterpret_cast<char*>(symbols.data()), symbols.size() * FlightRecorder::SYMBOL_BYTES);
+
+  uint64_t count = std::min(head, capacity);
+  std::cout << "# " << head << " events recorded, last " << count << " follow" << std::endl;
+  FlightRecord record;
+  while (count-- > 0 && in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    size_t event = static_cast<size_t>(record.event);
+    const char* name = event < std::size(EVENT_NAMES) ? EVENT_NAMES[event] : EVENT_NAMES[0];
+    const char* symbol = record.symbolId < symbols.size() ? symbols[record.symbolId].data() : "-";
+    char line[160];
+    snprintf(line, sizeof(line), "%u %llu %s %c %u %s %u %.5f", record.seq,
+             static_cast<unsigned long long>(record.ns), name, record.detail ? record.detail : '-', record.oid, symbol,
+             static_cast<unsigned>(record.qty), record.px);
+    std::cout << line << std::endl;
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// L3 Feed
+//
+// Order by order market data: every change to a resting order as a fixed size binary event, published by the engine
+// into a broadcast ring as it makes the change. Nothing is formatted and the engine never waits on a consumer. Any
+// number of consumer threads follow the ring, each with its own cursor; one that falls a whole ring behind is told it
+// has lost events (and must rebuild from a snapshot) instead of reading torn ones.
+//
+//   A  add      oid joins the back of its price level: symbol, side, qty, px
+//   E  execute  qty of oid traded at its px; an order executed down to 0 has left the book
+//   R  reduce   qty taken off oid, which keeps its place in the queue
+//   D  delete   oid left the book
+//   U  replace  oid is now newOid with qty, keeping its place in the queue (quote updates)
+//
+// Applied in sequence order the events rebuild the engine's books exactly, time priority included. writeL3Feed() is a
+// consumer that saves the stream to a file and decodeL3Feed() rebuilds the books from one.
+//----------------------------------------------------------------------------------------------------------------------
+struct L3Event {
+  uint64_t seq;       // feed sequence number, consecutive from 1
+  uint64_t ns;        // receive time of the inbound action that made the change
+  int64_t pxTicks;    // A and E, 1e-5 ticks
+  OrderId oid;
+  OrderId newOid;     // U
+  Quantity qty;       // A: open, E: executed, R: removed, U: open after the replace
+  char type;
+  char side;          // A
+  char symbol[8];     // A
+};
+static_assert(sizeof(L3Event) == 48, "L3 events are fixed size");
+
+class L3Feed {
+public:
+  static constexpr size_t DEFAULT_EVENTS = 1 << 16;
+  enum class Poll { EVENT, EMPTY, OVERRUN };
+
+  explicit L3Feed(size_t events=DEFAULT_EVENTS);
+  L3Feed(const L3Feed&) = delete;
+  L3Feed& operator=(const L3Feed&) = delete;
+
+  // Engine thread only. Assigns event.seq
+  void publish(L3Event& event) {
+    uint64_t seq = head.load(std::memory_order_relaxed) + 1;
+    Slot& slot = slots[seq & mask];
+    // A slot's version is 0 while it is rewritten, so a reader racing the write sees it change
+    slot.version.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.seq = seq;
+    uint64_t words[EVENT_WORDS];
+    std::memcpy(words, &event, sizeof(words));
+    for (size_t i = 0; i < EVENT_WORDS; i++) slot.words[i].store(words[i], std::memory_order_relaxed);
+    slot.version.store(seq, std::memory_order_release);
+    head.store(seq, std::memory_order_release);
+  }
+
+  // Any thread. cursor is the sequence number to read next, 1 for a new consumer, and moves past each event read
+  Poll poll(uint64_t& cursor, L3Event& event) const {
+    const Slot& slot = slots[cursor & mask];
+    if (slot.version.load(std::memory_order_acquire) != cursor) {
+      return head.load(std::memory_order_acquire) < cursor ? Poll::EMPTY : Poll::OVERRUN;
+    }
+    uint64_t words[EVENT_WORDS];
+    for (size_t i = 0; i < EVENT_WORDS; i++) words[i] = slot.words[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) != cursor) return Poll::OVERRUN;
+    std::memcpy(&event, words, sizeof(event));
+    cursor++;
+    return Poll::EVENT;
+  }
+
+  uint64_t published() const { return head.load(std::memory_order_acquire); }
+  size_t capacity() const { return mask + 1; }
+
+private:
+  static constexpr size_t EVENT_WORDS = sizeof(L3Event) / sizeof(uint64_t);
+
+  // One per cache line, so a consumer reading one event never shares a line the engine is writing. The event is held
+  // as relaxed atomic words: a reader may load them while the engine rewrites the slot, and only the version re-check
+  // tells it whether what it loaded is whole
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> version{0};
+    std::atomic<uint64_t> words[EVENT_WORDS] = {};
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head{0}; // last sequence number published
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+L3Feed::L3Feed(size_t events) {
+  size_t capacity = 1;
+  while (capacity < events) capacity <<= 1;
+  slots.reset(new Slot[capacity]);
+  mask = capacity - 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// The feed's consumer threads, which run until `done` is set and they have drained the ring. finish() sets it and joins
+// them, and so does going out of scope, so no exit path leaves a thread running
+//----------------------------------------------------------------------------------------------------------------------
+class L3Consumers {
+public:
+  L3Consumers() = default;
+  ~L3Consumers() { finish(); }
+  L3Consumers(const L3Consumers&) = delete;
+  L3Consumers& operator=(const L3Consumers&) = delete;
+
+  const std::atomic<bool>& done() const { return doneFlag; }
+  template<typename F>
+  void start(F&& consumer) { threads.emplace_back(std::forward<F>(consumer)); }
+  void finish() {
+    doneFlag.store(true, std::memory_order_release);
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+  }
+
+private:
+  std::atomic<bool> doneFlag{false};
+  std::vector<std::thread> threads;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Consumer thread: append every event published to `path` until `done` is set and the ring is drained
+//----------------------------------------------------------------------------------------------------------------------
+bool writeL3Feed(const L3Feed& feed, const std::string& path, const std::atomic<bool>& done) {
+  std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  uint64_t cursor = 1;
+  L3Event event;
+  for (;;) {
+    L3Feed::Poll poll = feed.poll(cursor, event);
+    if (poll == L3Feed::Poll::EVENT) {
+      out.write(reinterpret_cast<const char*>(&event), sizeof(event));
+    } else if (poll == L3Feed::Poll::OVERRUN) {
+      std::cerr << "L3 feed overran its consumer, events from " << cursor << " lost" << std::endl;
+      return false;
+    } else if (done.load(std::memory_order_acquire) && cursor > feed.published()) {
+      return true;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Reference L3 consumer: the books rebuilt from events applied in sequence order, printed as P results in the engine's
+// order. Counts sequence gaps and events for orders not in the book, both 0 for a complete feed
+//----------------------------------------------------------------------------------------------------------------------
+class L3Book {
+public:
+  void apply(const L3Event& event);
+  void print(std::ostream& out) const;
+
+  uint64_t events() const { return applied; }
+  uint64_t gaps() const { return gapCount; }
+  uint64_t unknown() const { return unknownCount; }
+
+private:
+  typedef std::list<OrderId> Queue;
+  struct Book { std::map<int64_t, Queue> levels[2]; }; // sells, buys
+  struct Resting { Book* book; int side; int64_t pxTicks; Quantity qty; Queue::iterator position; };
+
+  void _remove(std::unordered_map<OrderId, Resting>::iterator it);
+
+private:
+  std::map<Symbol, Book> books;
+  std::unordered_map<OrderId, Resting> orders;
+  uint64_t applied = 0;
+  uint64_t gapCount = 0;
+  uint64_t unknownCount = 0;
+  uint64_t lastSeq = 0;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Book::apply(const L3Event& event) {
+  applied++;
+  if (event.seq != lastSeq + 1) gapCount++;
+  lastSeq = event.seq;
+
+  if (event.type == 'A') {
+    Book& book = books[Symbol(event.symbol, strnlen(event.symbol, sizeof(event.symbol)))];
+    int side = event.side == static_cast<char>(Side::BUY);
+    Queue& queue = book.levels[side][event.pxTicks];
+    Resting resting{ &book, side, event.pxTicks, event.qty, queue.insert(queue.end(), event.oid) };
+    if (!orders.emplace(event.oid, resting).second) unknownCount++;
+    return;
+  }
+
+  auto it = orders.find(event.oid);
+  if (it == orders.end()) {
+    unknownCount++;
+    return;
+  }
+  Resting& resting = it->second;
+  if (event.type == 'E' || event.type == 'R') {
+    resting.qty -= std::min(resting.qty, event.qty);
+    if (resting.qty == 0) _remove(it);
+  } else if (event.type == 'D') {
+    _remove(it);
+  } else if (event.type == 'U') {
+    Resting replaced = resting;
+    *replaced.position = event.newOid;
+    replaced.qty = event.qty;
+    orders.erase(it);
+    if (!orders.emplace(event.newOid, replaced).second) unknownCount++;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Book::_remove(std::unordered_map<OrderId, Resting>::iterator it) {
+  std::map<int64_t, Queue>& levels = it->second.book->levels[it->second.side];
+  auto level = levels.find(it->second.pxTicks);
+  level->second.erase(it->second.position);
+  if (level->second.empty()) levels.erase(level);
+  orders.erase(it);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Book::print(std::ostream& out) const {
+  if (books.empty()) out << "Book empty!" << std::endl;
+  for (const auto& [symbol, book] : books) {
+    for (int side : { 0, 1 }) {
+      for (auto level = book.levels[side].rbegin(); level != book.levels[side].rend(); ++level) {
+        for (OrderId oid : level->second) {
+          out << "P " << oid << " " << symbol << " " << (side ? 'B' : 'S') << " " << orders.at(oid).qty << " "
+              << std::to_string(JournalFormat::fromTicks(level->first)) << std::endl;
+        }
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Rebuild the books from a file of L3 events, then a "#" summary line
+//----------------------------------------------------------------------------------------------------------------------
+int decodeL3Feed(const std::string& path) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in) {
+    std::cerr << "Cannot open " << path << std::endl;
+    return 1;
+  }
+
+  L3Book book;
+  L3Event event;
+  while (in.read(reinterpret_cast<char*>(&event), sizeof(event))) book.apply(event);
+  book.print(std::cout);
+  std::cout << "# " << book.events() << " events, " << book.gaps() << " gaps, " << book.unknown() << " unknown orders"
+            << std::endl;
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// L3 over UDP
+//
+// The L3 feed as sequenced datagrams, MoldUDP64 style. Each packet carries as many whole events as fit one Ethernet
+// MTU after a header naming the sequence number of its first event; the publisher sends a packet when it is full or
+// when the feed has nothing more ready, so a quiet book doesn't hold events back. An empty packet flagged END closes
+// the session and names the sequence number that would have come next, also flagged LOST if the publisher fell a whole
+// ring behind the engine and the session was cut short there.
+//
+// Datagrams can be lost, so the publisher keeps its most recent packets in memory and serves them again over TCP. A
+// subscriber that sees a gap (or hears nothing for a while) asks for the missing range, applies the reply and carries
+// on. The reply is the packets overlapping the range, then an empty packet holding the next sequence number, flagged
+// LOST if the range starts before the oldest packet held or the session was cut short, and END if the session is over
+// and nothing follows.
+//
+//   PACKET  := MAGIC(u32) COUNT(u16) FLAGS(u16) SEQ(u64) L3Event[COUNT]      (native layout)
+//   REQUEST := SEQ(u64) COUNT(u32)                                          (over TCP)
+//   REPLY   := (BYTES(u16) PACKET)+
+//----------------------------------------------------------------------------------------------------------------------
+struct L3Packet {
+  static constexpr uint32_t MAGIC = 0x334c5853; // "SXL3"
+  static constexpr size_t HEADER_BYTES = 16;
+  static constexpr size_t MAX_BYTES = 1472; // 1500 byte MTU less IPv4 and UDP headers
+  static constexpr size_t MAX_EVENTS = (MAX_BYTES - HEADER_BYTES) / sizeof(L3Event);
+  static constexpr uint16_t FLAG_END = 0x01;
+  static constexpr uint16_t FLAG_LOST = 0x02;
+
+  uint32_t magic = MAGIC;
+  uint16_t count = 0;
+  uint16_t flags = 0;
+  uint64_t seq = 0;
+  L3Event events[MAX_EVENTS];
+
+  size_t bytes() const { return HEADER_BYTES + count * sizeof(L3Event); }
+  bool valid(size_t received) const {
+    return received >= HEADER_BYTES && magic == MAGIC && count <= MAX_EVENTS && received == bytes();
+  }
+};
+static_assert(offsetof(L3Packet, events) == L3Packet::HEADER_BYTES, "events follow the header");
+
+// "HOST:PORT", IPv4
+bool parseInetAddress(const std::string& text, sockaddr_in& addr) {
+  size_t colon = text.rfind(':');
+  if (colon == std::string::npos) return false;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  unsigned port;
+  auto [ptr, ec] = std::from_chars(text.data() + colon + 1, text.data() + text.size(), port);
+  if (ec != std::errc() || ptr != text.data() + text.size() || port > UINT16_MAX) return false;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  return inet_pton(AF_INET, text.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+class L3Publisher {
+public:
+  static constexpr size_t HISTORY_PACKETS = 1 << 14;
+  static constexpr int LINGER_MS = 2000;
+
+  // dropEvery > 0 skips sending every dropEvery-th packet (still served by retransmit), to exercise gap recovery
+  explicit L3Publisher(const L3Feed& _feed, unsigned _dropEvery=0) : feed(_feed), dropEvery(_dropEvery) {}
+  ~L3Publisher();
+  L3Publisher(const L3Publisher&) = delete;
+  L3Publisher& operator=(const L3Publisher&) = delete;
+
+  // Send to udp and listen for retransmit requests on retransmit, both "HOST:PORT". false if either socket fails
+  bool open(const std::string& udp, const std::string& retransmit);
+
+  // Publisher thread: packetize the feed until done is set and the feed drained, then end the session
+  bool run(const std::atomic<bool>& done);
+  // Retransmit thread: serve one client at a time until the session has ended and none has connected for LINGER_MS
+  void serveRetransmits();
+
+private:
+  void _send(const L3Packet& packet);
+  void _serveClient(int fd);
+
+private:
+  const L3Feed& feed;
+  unsigned dropEvery;
+  int udpFd = -1;
+  int listenFd = -1;
+  sockaddr_in destination;
+
+  std::mutex historyLock; // publisher and retransmit threads
+  std::vector<L3Packet> history; // packet n in history[n % HISTORY_PACKETS]
+  uint64_t packets = 0;
+  uint64_t endSeq = 0; // set when the session ends
+  bool overran = false; // the session ended early, its events from endSeq lost
+  std::atomic<bool> ended{false};
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+L3Publisher::~L3Publisher() {
+  if (udpFd >= 0) close(udpFd);
+  if (listenFd >= 0) close(listenFd);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool L3Publisher::open(const std::string& udp, const std::string& retransmit) {
+  sockaddr_in listenAddr;
+  if (!parseInetAddress(udp, destination) || !parseInetAddress(retransmit, listenAddr)) return false;
+
+  udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if (udpFd < 0 || listenFd < 0) return false;
+  int on = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(listenFd, reinterpret_cast<sockaddr*>(&listenAddr), sizeof(listenAddr)) != 0 || listen(listenFd, 4) != 0) {
+    return false;
+  }
+
+  history.resize(HISTORY_PACKETS);
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool L3Publisher::run(const std::atomic<bool>& done) {
+  uint64_t cursor = 1;
+  bool complete = true;
+  L3Packet packet;
+  packet.seq = cursor;
+
+  for (;;) {
+    L3Feed::Poll poll = feed.poll(cursor, packet.events[packet.count]);
+    if (poll == L3Feed::Poll::EVENT) {
+      if (++packet.count < L3Packet::MAX_EVENTS) continue;
+    } else if (poll == L3Feed::Poll::OVERRUN) {
+      std::cerr << "L3 feed overran its UDP publisher, events from " << cursor << " lost" << std::endl;
+      complete = false;
+      break;
+    } else if (packet.count == 0) {
+      if (done.load(std::memory_order_acquire) && cursor > feed.published()) break;
+      std::this_thread::yield();
+      continue;
+    }
+
+    // Full, or nothing more ready
+    _send(packet);
+    packet.seq = cursor;
+    packet.count = 0;
+  }
+
+  // An overrun ends the session short, flagged lost so subscribers don't take their books as the engine's
+  if (packet.count != 0) _send(packet);
+  L3Packet end;
+  end.flags = complete ? L3Packet::FLAG_END : L3Packet::FLAG_END | L3Packet::FLAG_LOST;
+  end.seq = cursor;
+  {
+    std::lock_guard<std::mutex> guard(historyLock);
+    endSeq = cursor;
+    overran = !complete;
+  }
+  ended.store(true, std::memory_order_release);
+  sendto(udpFd, &end, end.bytes(), 0, reinterpret_cast<sockaddr*>(&destination), sizeof(destination));
+  return complete;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Publisher::_send(const L3Packet& packet) {
+  uint64_t number;
+  {
+    std::lock_guard<std::mutex> guard(historyLock);
+    number = packets++;
+    std::memcpy(&history[number % HISTORY_PACKETS], &packet, packet.bytes());
+  }
+  if (dropEvery != 0 && (number + 1) % dropEvery == 0) return;
+  sendto(udpFd, &packet, packet.bytes(), 0, reinterpret_cast<sockaddr*>(&destination), sizeof(destination));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Publisher::serveRetransmits() {
+  auto idleSince = std::chrono::steady_clock::now();
+  for (;;) {
+    pollfd ready = { listenFd, POLLIN, 0 };
+    if (::poll(&ready, 1, 100) > 0) {
+      int fd = accept(listenFd, nullptr, nullptr);
+      if (fd >= 0) {
+        _serveClient(fd);
+        close(fd);
+      }
+      idleSince = std::chrono::steady_clock::now();
+      continue;
+    }
+
+    // The linger runs from the end of the session or the last client, whichever is later
+    if (!ended.load(std::memory_order_acquire)) {
+      idleSince = std::chrono::steady_clock::now();
+    } else if (std::chrono::steady_clock::now() - idleSince > std::chrono::milliseconds(LINGER_MS)) {
+      return;
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Publisher::_serveClient(int fd) {
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  uint8_t request[12];
+  while (recv(fd, request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+    uint64_t seq;
+    uint32_t count;
+    std::memcpy(&seq, request, sizeof(seq));
+    std::memcpy(&count, request + 8, sizeof(count));
+    uint64_t last = seq + count; // one past
+
+    // Copied out under the lock, sent after it
+    std::vector<L3Packet> reply;
+    L3Packet tail;
+    {
+      std::lock_guard<std::mutex> guard(historyLock);
+      uint64_t oldest = packets > HISTORY_PACKETS ? packets - HISTORY_PACKETS : 0;
+      uint64_t held = packets > 0 ? history[oldest % HISTORY_PACKETS].seq : 1;
+      tail.seq = seq;
+      if (oldest > 0 && seq < held) tail.flags |= L3Packet::FLAG_LOST;
+
+      // Packets cover consecutive ranges, so find the first that ends past seq
+      uint64_t lo = oldest, hi = packets;
+      while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const L3Packet& packet = history[mid % HISTORY_PACKETS];
+        if (packet.seq + packet.count <= seq) lo = mid + 1; else hi = mid;
+      }
+      for (uint64_t n = lo; n < packets && history[n % HISTORY_PACKETS].seq < last; n++) {
+        reply.push_back(history[n % HISTORY_PACKETS]);
+        tail.seq = reply.back().seq + reply.back().count;
+      }
+      if (ended.load(std::memory_order_relaxed) && tail.seq >= endSeq) {
+        tail.flags |= overran ? L3Packet::FLAG_END | L3Packet::FLAG_LOST : L3Packet::FLAG_END;
+      }
+    }
+
+    // One write for the whole reply
+    reply.push_back(tail);
+    std::vector<uint8_t> out;
+    for (const L3Packet& packet : reply) {
+      uint16_t bytes = static_cast<uint16_t>(packet.bytes());
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(&packet);
+      out.insert(out.end(), reinterpret_cast<const uint8_t*>(&bytes), reinterpret_cast<const uint8_t*>(&bytes + 1));
+      out.insert(out.end(), data, data + bytes);
+    }
+    if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size())) return;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Loopback reference subscriber: rebuild the books from the UDP feed, filling gaps from the retransmit server
+//----------------------------------------------------------------------------------------------------------------------
+class L3Subscriber {
+public:
+  static constexpr int RECEIVE_TIMEOUT_MS = 200;
+  static constexpr int SILENCE_LIMIT_MS = 30000; // before the first packet
+
+  explicit L3Subscriber(L3Book& _book) : book(_book) {}
+  ~L3Subscriber();
+  L3Subscriber(const L3Subscriber&) = delete;
+  L3Subscriber& operator=(const L3Subscriber&) = delete;
+
+  // Listen for the feed on udp and ask retransmit for gaps, both "HOST:PORT". false if the socket fails
+  bool open(const std::string& udp, const std::string& retransmit);
+  // Apply the session through its end. false if the feed never came or events were lost for good
+  bool run();
+
+  uint64_t packetsReceived() const { return received; }
+  uint64_t gapsFilled() const { return gaps; }
+  uint64_t eventsRetransmitted() const { return retransmitted; }
+
+private:
+  void _apply(const L3Packet& packet, bool retransmit);
+  bool _fill(uint64_t count);
+
+private:
+  L3Book& book;
+  int udpFd = -1;
+  int tcpFd = -1;
+  sockaddr_in server;
+
+  uint64_t expected = 1; // next sequence number to apply
+  uint64_t endSeq = 0;   // known once the session has ended
+  bool ended = false;
+  bool lost = false;
+  uint64_t received = 0;
+  uint64_t gaps = 0;
+  uint64_t retransmitted = 0;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+L3Subscriber::~L3Subscriber() {
+  if (udpFd >= 0) close(udpFd);
+  if (tcpFd >= 0) close(tcpFd);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool L3Subscriber::open(const std::string& udp, const std::string& retransmit) {
+  sockaddr_in local;
+  if (!parseInetAddress(udp, local) || !parseInetAddress(retransmit, server)) return false;
+
+  udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (udpFd < 0) return false;
+  // Room for bursts while this process is descheduled, gaps are filled either way
+  int bufferBytes = 8 << 20;
+  setsockopt(udpFd, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes));
+  timeval timeout = { 0, RECEIVE_TIMEOUT_MS * 1000 };
+  setsockopt(udpFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return bind(udpFd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+bool L3Subscriber::run() {
+  L3Packet packet;
+  int silentMs = 0;
+  while (!lost && !(ended && expected >= endSeq)) {
+    ssize_t bytes = recv(udpFd, &packet, sizeof(packet), 0);
+    if (bytes < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+      // Quiet: the tail of the session, its end included, may be what was lost
+      if (received > 0) {
+        if (!_fill(UINT32_MAX)) return false;
+      } else if ((silentMs += RECEIVE_TIMEOUT_MS) >= SILENCE_LIMIT_MS) {
+        return false;
+      }
+      continue;
+    }
+    if (!packet.valid(bytes)) continue;
+
+    received++;
+    if (packet.seq > expected && !_fill(packet.seq - expected)) return false;
+    _apply(packet, false);
+    if (ended && expected < endSeq && !_fill(endSeq - expected)) return false;
+  }
+  return !lost;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void L3Subscriber::_apply(const L3Packet& packet, bool retransmit) {
+  if (packet.flags & L3Packet::FLAG_LOST) lost = true;
+  if (packet.flags & L3Packet::FLAG_END) {
+    ended = true;
+    endSeq = packet.seq;
+  }
+
+  // Packets can overlap what was already applied, and a gap here is left for the caller to fill
+  if (packet.seq > expected) return;
+  for (uint64_t i = expected - packet.seq; i < packet.count; i++) {
+    book.apply(packet.events[i]);
+    expected++;
+    if (retransmit) retransmitted++;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Request count events from expected and apply the reply. false if the server can't be reached
+//----------------------------------------------------------------------------------------------------------------------
+bool L3Subscriber::_fill(uint64_t count) {
+  if (tcpFd < 0) {
+    for (int waited = 0; tcpFd < 0; waited += 10) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (fd < 0) return false;
+      if (connect(fd, reinterpret_cast<sockaddr*>(&server), sizeof(server)) == 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        tcpFd = fd;
+      } else {
+        close(fd);
+        if (waited >= 5000) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+  }
+
+  uint8_t request[12];
+  uint32_t requested = static_cast<uint32_t>(std::min<uint64_t>(count, UINT32_MAX));
+  std::memcpy(request, &expected, sizeof(expected));
+  std::memcpy(request + 8, &requested, sizeof(requested));
+  if (send(tcpFd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) return false;
+
+  uint64_t before = expected;
+  L3Packet packet;
+  for (;;) {
+    uint16_t bytes;
+    if (recv(tcpFd, &bytes, sizeof(bytes), MSG_WAITALL) != sizeof(bytes) || bytes > sizeof(packet)
+        || recv(tcpFd, &packet, bytes, MSG_WAITALL) != bytes || !packet.valid(bytes)) {
+      return false;
+    }
+    _apply(packet, true);
+    if (packet.count == 0) break;
+  }
+  if (expected != before) gaps++;
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Subscribe to a loopback feed, then print the rebuilt books and a "#" summary line
+//----------------------------------------------------------------------------------------------------------------------
+int subscribeL3(const std::string& udp, const std::string& retransmit) {
+  L3Book book;
+  L3Subscriber subscriber(book);
+  if (!subscriber.open(udp, retransmit)) {
+    std::cerr << "Cannot listen for the L3 feed on " << udp << std::endl;
+    return 1;
+  }
+  bool complete = subscriber.run();
+
+  book.print(std::cout);
+  std::cout << "# " << book.events() << " events, " << book.gaps() << " gaps, " << book.unknown() << " unknown orders, "
+            << subscriber.packetsReceived() << " packets, " << subscriber.gapsFilled() << " gaps filled with "
+            << subscriber.eventsRetransmitted() << " retransmitted events" << std::endl;
+  if (!complete) std::cerr << "L3 feed incomplete, the books above are not the engine's" << std::endl;
+  return complete ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Drop Copy
+//
+// Every execution, both sides of it, for back office consumers. The engine hands each execution to the drop copy
+// channel through a lock free single producer single consumer queue and moves on; should the queue ever be full it
+// holds the overflow itself and retries after the action, so executions are never dropped and the matcher never
+// waits. The channel thread appends them to an in-memory log, and any number of consumer threads read the log at
+// their own pace, each with its own cursor and its own output (see runDropCopyConsumer). The log only keeps what some
+// consumer has yet to read, and never more than RETAINED_EXECUTIONS of that: a consumer that falls further behind
+// is told how many executions it lost and carries on from the oldest one kept.
+//----------------------------------------------------------------------------------------------------------------------
+// Bounded lock free queue from one producer thread to one consumer thread
+template <typename T>
+class SpscRing {
+public:
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    slots.resize(size);
+    mask = size - 1;
+  }
+
+  // Producer thread only
+  bool tryPush(T& value) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) return false;
+    slots[t & mask] = std::move(value);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Either thread, a snapshot
+  bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+  // Consumer thread only
+  bool tryPop(T& value) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    value = std::move(slots[h & mask]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0}; // next slot to pop, written by the consumer
+  alignas(64) std::atomic<size_t> tail{0}; // next slot to push, written by the producer
+};
+
+// One execution: the inbound order traded qty at the resting order's px. Identified by the action's sequence number
+// and match, its executions numbered from 1, which recovery preserves
+struct Execution {
+  uint64_t actionSeq;
+  uint64_t ns;        // receive time of the action
+  int64_t pxTicks;    // 1e-5 ticks
+  OrderId buyOid;
+  OrderId sellOid;
+  uint32_t match;
+  Quantity qty;
+  char aggressor;     // side of the inbound order
+  char symbol[8];
+};
+
+class DropCopy {
+public:
+  static constexpr size_t QUEUE_EXECUTIONS = 1 << 14;
+  static constexpr size_t RETAINED_EXECUTIONS = 1 << 22;
+
+  DropCopy() : queue(QUEUE_EXECUTIONS) {}
+  DropCopy(const DropCopy&) = delete;
+  DropCopy& operator=(const DropCopy&) = delete;
+
+  // Engine thread. Overflow keeps its place behind anything already waiting
+  void publish(Execution execution) {
+    if (overflow.empty() && queue.tryPush(execution)) return;
+    overflow.push_back(execution);
+  }
+  void retryOverflow() {
+    while (!overflow.empty() && queue.tryPush(overflow.front())) overflow.pop_front();
+  }
+  // Engine thread, once it is done trading: hand over the overflow and let the channel run dry
+  void finish();
+  // Engine thread: the channel has taken everything published so far
+  bool drained() const { return overflow.empty() && queue.empty(); }
+
+  // Channel thread: move executions from the queue to the log until finished and drained
+  void run();
+
+  // Register a consumer, before its thread starts. It reads from the oldest execution kept
+  size_t subscribe();
+  // Consumer threads: copy up to max of consumer's next executions into out, waiting for at least one. Reading
+  // acknowledges the executions read before, which the log may then drop. Returns the number copied, 0 once the stream
+  // has ended; lost is the number of executions dropped before the consumer got to them
+  size_t read(size_t consumer, std::vector<Execution>& out, size_t max, uint64_t& lost);
+
+private:
+  // Drop executions every consumer has read, and the oldest past RETAINED_EXECUTIONS
+  void _trim();
+
+private:
+  SpscRing<Execution> queue;
+  std::deque<Execution> overflow; // engine thread only
+  std::atomic<bool> finished{false};
+
+  std::mutex logLock;
+  std::condition_variable logged;
+  std::deque<Execution> log;
+  uint64_t logBase = 0; // position of log.front() in the stream
+  std::vector<uint64_t> cursors; // next position each consumer reads
+  bool ended = false;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+void DropCopy::finish() {
+  while (!overflow.empty()) {
+    retryOverflow();
+    std::this_thread::yield();
+  }
+  finished.store(true, std::memory_order_release);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void DropCopy::run() {
+  std::vector<Execution> batch;
+  for (;;) {
+    // Checked before draining, so everything pushed before finish() is taken on the way out
+    bool last = finished.load(std::memory_order_acquire);
+    Execution execution;
+    while (batch.size() < QUEUE_EXECUTIONS && queue.tryPop(execution)) batch.push_back(execution);
+
+    if (!batch.empty()) {
+      std::lock_guard<std::mutex> guard(logLock);
+      log.insert(log.end(), batch.begin(), batch.end());
+      _trim();
+      batch.clear();
+      logged.notify_all();
+    } else if (last) {
+      std::lock_guard<std::mutex> guard(logLock);
+      ended = true;
+      logged.notify_all();
+      return;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+size_t DropCopy::subscribe() {
+  std::lock_guard<std::mutex> guard(logLock);
+  cursors.push_back(logBase);
+  return cursors.size() - 1;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+size_t DropCopy::read(size_t consumer, std::vector<Execution>& out, size_t max, uint64_t& lost) {
+  std::unique_lock<std::mutex> guard(logLock);
+  logged.wait(guard, [&]() { return cursors[consumer] < logBase + log.size() || ended; });
+  // Looked up after the wait, subscribe() may have moved it
+  uint64_t& cursor = cursors[consumer];
+  lost = cursor < logBase ? logBase - cursor : 0;
+  cursor += lost;
+
+  size_t first = cursor - logBase;
+  size_t count = std::min<size_t>(max, log.size() - first);
+  out.assign(log.begin() + first, log.begin() + first + count);
+  cursor += count;
+  _trim();
+  return count;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void DropCopy::_trim() {
+  uint64_t keepFrom = logBase + log.size();
+  for (uint64_t cursor : cursors) keepFrom = std::min(keepFrom, cursor);
+  if (log.size() > RETAINED_EXECUTIONS) keepFrom = std::max(keepFrom, logBase + log.size() - RETAINED_EXECUTIONS);
+  if (keepFrom <= logBase) return;
+  log.erase(log.begin(), log.begin() + (keepFrom - logBase));
+  logBase = keepFrom;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// A drop copy consumer appending execution reports to path, one per line:
+//   D ACTION_SEQ MATCH SYMBOL QTY PX BUY_OID SELL_OID AGGRESSOR NS
+//----------------------------------------------------------------------------------------------------------------------
+void runDropCopyConsumer(DropCopy& channel, size_t consumer, const std::string& path) {
+  std::ofstream out(path, std::ios::out | std::ios::app);
+  std::vector<Execution> batch;
+  uint64_t lost;
+  while (channel.read(consumer, batch, 1024, lost) != 0) {
+    if (lost != 0) std::cerr << "Drop copy " << path << " fell behind, " << lost << " executions lost" << std::endl;
+    for (const Execution& execution : batch) {
+      char line[160];
+      snprintf(line, sizeof(line), "D %llu %u %.*s %u %.6f %u %u %c %llu",
+               static_cast<unsigned long long>(execution.actionSeq), execution.match,
+               static_cast<int>(strnlen(execution.symbol, sizeof(execution.symbol))), execution.symbol,
+               static_cast<unsigned>(execution.qty), JournalFormat::fromTicks(execution.pxTicks), execution.buyOid,
+               execution.sellOid, execution.aggressor, static_cast<unsigned long long>(execution.ns));
+      out << line << '\n';
+    }
+    out.flush();
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Synthetic Workloads
+//
+// Deterministic order flow used by benchmarks: sequential OIDs, a few hundred symbols whose prices random walk around
+// their own mid, and cancels of recently placed orders. Orders are priced symmetrically around the mid, or, for a
+// passive flow, on their own side of it with only a given share priced to cross.
+//----------------------------------------------------------------------------------------------------------------------
+class SyntheticFlow {
+public:
+  SyntheticFlow(size_t _symbols=500, uint64_t seed=42, OrderId firstOid=1)
+    : rng(seed)
+    , nextOid(firstOid)
+  {
+    for (size_t i = 0; i < _symbols; i++) {
+      symbols.push_back("S" + std::to_string(10000 + i));
+      mids.push_back(static_cast<int64_t>(10 + rng() % 490) * 100000);
+    }
+  }
+
+  // Bids below and offers above the mid across `levels` price levels, except for `aggressivePercent` of orders which
+  // are priced through it
+  void setPassive(unsigned aggressivePercent, unsigned levels=5) {
+    passive = true;
+    aggressive = aggressivePercent;
+    depth = levels;
+  }
+
+  ActionRecord next() {
+    ActionRecord record;
+    uint64_t roll = rng() % 100;
+    if (roll < 35 && !live.empty()) {
+      // Cancel a random live order
+      size_t i = rng() % live.size();
+      record.action = Action::CANCEL;
+      record.order.oid = live[i];
+      live[i] = live.back();
+      live.pop_back();
+      return record;
+    }
+
+    size_t s = rng() % symbols.size();
+    int64_t step = (static_cast<int64_t>(rng() % 5) - 2) * 1000;
+    if (!passive) mids[s] = std::max<int64_t>(mids[s] + step, 1000); // passive flows quote around a fixed mid
+    record.action = Action::PLACE;
+    record.order.oid = nextOid++;
+    record.order.symbol = symbols[s];
+    record.order.side = rng() % 2 ? Side::BUY : Side::SELL;
+    record.order.qty = static_cast<Quantity>(1 + rng() % 10) * 100;
+    int64_t offset = (static_cast<int64_t>(rng() % 11) - 5) * 1000;
+    if (passive) {
+      bool buy = record.order.side == Side::BUY;
+      int64_t away = static_cast<int64_t>(1 + rng() % depth) * 1000;
+      int64_t through = static_cast<int64_t>(depth) * 1000;
+      offset = rng() % 100 < aggressive ? (buy ? through : -through) : (buy ? -away : away);
+    }
+    record.order.px = JournalFormat::fromTicks(mids[s] + offset);
+    live.push_back(record.order.oid);
+    return record;
+  }
+
+  static std::string format(const ActionRecord& record) {
+    char px[32];
+    if (record.action == Action::PLACE) {
+      snprintf(px, sizeof(px), "%.5f", record.order.px);
+      return "O " + std::to_string(record.order.oid) + " " + record.order.symbol + " "
+        + std::string(1, record.order.side) + " " + std::to_string(record.order.qty) + " " + px;
+    } else if (record.action == Action::CANCEL) {
+      return "X " + std::to_string(record.order.oid);
+    }
+    return "P";
+  }
+
+private:
+  std::mt19937_64 rng;
+  OrderId nextOid;
+  std::vector<Symbol> symbols;
+  std::vector<int64_t> mids;
+  std::vector<OrderId> live;
+  bool passive = false;
+  unsigned aggressive = 0;
+  unsigned depth = 5;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+// Simple Cross Order Book Driver
+//
+// Templated on the price levels container (see Price Levels); SimpleCross is the std::map instance
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+class BasicSimpleCross {
+public:
+  typedef Levels PriceLevels;
+
+  results_t action(const std::string line);
+
+  // Binary entry point for a parsed, validated action (journal, replay, benchmarks). Events still reach the event log
+  // and flight recorder but no text results are formatted, so once warmed up this path does not touch the heap
+  void apply(ActionRecord& record) { _apply(record.action, record.order, nullptr, record.quote); }
+
+  // apply() over a run of records. Consecutive cancels are taken CANCEL_GROUP at a time with the memory each one will
+  // touch prefetched stage by stage across the group, so a cancel storm overlaps its cache misses instead of taking
+  // them one after another. Results are exactly those of applying the records one by one
+  void applyBatch(ActionRecord* records, size_t count);
+
+  // Optional outputs: trailing "SEQ NS ACTION_SEQ ACTION_NS" fields on text results, and a binary EventRecord log
+  void setStampedResults(bool enabled) { stampResults = enabled; }
+  void setEventLog(std::ostream* out) { eventLog = out; }
+  void setL3Feed(L3Feed* feed) { l3 = feed; }
+  // Executions from here on, so attach it after recovery
+  void setDropCopy(DropCopy* channel) { dropCopy = channel; }
+  uint64_t lastSequence() const { return sequence; }
+
+  const FlightRecorder& flightRecorder() const { return flight; }
+  const EngineStats& engineStats() const { return stats; }
+
+  // Persistence. Actions are journaled before they are applied, and written out a block at a time; recover() replays
+  // snapshot and action blocks in order, except what a restored book image already holds: with `imageSeq` set, every
+  // snapshot and the action records up to that sequence. Snapshots and images hold resting orders only, so the OIDs of
+  // orders that left the book before them are free again after a restore from one
+  void setJournal(JournalWriter* writer) { journal = writer; }
+  void writeSnapshot(std::ostream& out);
+  size_t recover(std::istream& in, std::optional<uint64_t> imageSeq=std::nullopt);
+  size_t recoverParallel(std::istream& in, unsigned threads=std::thread::hardware_concurrency());
+
+  // Replication (see Replication). A primary also journals every action to the replica, a stamped action stream with
+  // one record per block, and follows every checkpointEvery-th action with a checkpoint of its book hash. A standby
+  // follow()s such a stream until it ends, returning the number of records applied
+  static constexpr uint64_t DEFAULT_CHECKPOINT_EVERY = 1000;
+  void setReplica(JournalWriter* writer, uint64_t checkpointEvery=DEFAULT_CHECKPOINT_EVERY) {
+    replica = writer;
+    replicaCheckpointEvery = std::max<uint64_t>(checkpointEvery, 1);
+  }
+  size_t follow(std::istream& in);
+
+  // Book image (see BookImage). An image holding committed actions is restored into this engine, which must be empty,
+  // and recover() then takes the journal from image.actionSeq(). An empty image is filled from the engine's books as
+  // they stand, so attach it after recovery. Either way every change from here on is written through to the image.
+  // False, leaving the engine to be discarded, if the image's books are inconsistent
+  bool attachImage(BookImage& image);
+
+  // Prefault this thread's arena, the order pool and index pages for `orders` resting orders, then prime caches,
+  // allocator free lists and branch history with a synthetic burst run against a scratch engine. Call from the thread
+  // that will drive the engine, before the first real action
+  void warmUp(size_t orders=1 << 20, size_t syntheticActions=100000);
+
+private:
+  // Compact decoded journal record, symbol held as an index into the replay's symbol table
+  struct ReplayEntry {
+    uint64_t seq; OrderId oid; Price px; Quantity qty; Action action; Side side; bool snapshot; QuoteFields quote;
+    uint64_t hash;
+  };
+
+  void _replaySymbol(const std::vector<ReplayEntry>& entries, const Symbol& symbol);
+  void _replay(JournalBlock kind, ActionRecord& record);
+  // Prints change nothing, so neither the journal nor the replica carries them (the writer drops the other queries)
+  void _journal(Action action, const Order &order, const QuoteFields &quote=QuoteFields()) {
+    if (action == Action::PRINT) return;
+    if (journal) journal->append(action, order, actionStamp, quote);
+    if (replica) replica->append(action, order, actionStamp, quote);
+  }
+  // Once the action it covers is applied
+  void _checkpoint() {
+    if (replica && ++replicated % replicaCheckpointEvery == 0) replica->appendCheckpoint(bookHash, actionStamp);
+  }
+
+  void _apply(Action action, Order &order, results_t *results, const QuoteFields &quote=QuoteFields());
+  void _restOrder(Order &order);
+  void _cancelGroup(ActionRecord* records, size_t count);
+
+  RejectReason _parseAction(const std::vector<std::string> &fields, Action action, Order &order, QuoteFields &quote);
+  RejectReason _parseOrder(const std::vector<std::string> &fields, size_t first, Order &order);
+  RejectReason _parseQuote(const std::vector<std::string> &fields, Order &bid, QuoteFields &quote);
+  void _bulk(const std::vector<std::string> &fields, results_t *results);
+  // oidChecked skips the duplicate check for a caller that has vetted the OID itself
+  bool _placeOrder(Order &order, std::vector<Fill> &fills, bool oidChecked=false);
+  bool _cancelOrder(OrderId oid);
+  RejectReason _quote(Order &bid, const QuoteFields &quote, std::vector<Fill> &fills, OrderId &rejectOid);
+  void _requote(OrderHandle handle, const Order &order);
+  void _adoptQuote(uint32_t pid, OrderId oid);
+  void _forgetQuote(const RestingOrder &resting);
+  uint64_t _orderKey(const RestingOrder &resting);
+  uint64_t _linkKey(SymbolId symbolId, OrderId ahead, OrderId behind) {
+    return BookHash::mix(~hotBooks[symbolId].seed ^ (static_cast<uint64_t>(ahead) << 32 | behind));
+  }
+  void _toggleKey(SymbolId symbolId, uint64_t key) {
+    hotBooks[symbolId].hash ^= key;
+    bookHash ^= key;
+  }
+  void _toggleKeys(OrderHandle handle);
+  void _linkOrder(OrderQueue &queue, OrderHandle handle);
+  void _unlinkOrder(OrderQueue &queue, OrderHandle handle);
+  void _reduceOrder(OrderQueue &queue, OrderHandle handle, Quantity qty);
+  void _verifyHash(const Symbol &symbol, uint64_t expected);
+  void _printSortedBook(results_t *results);
+  void _printFills(const std::vector<Fill> &fills, results_t *results);
+  void _printCancel(OrderId oid, results_t *results);
+  bool _printPosition(OrderId oid, results_t *results);
+  void _printHash(const Symbol &symbol, results_t *results);
+  void _printStats(results_t *results);
+  void _reject(RejectReason reason, Action action, OrderId oid, results_t *results);
+  template<typename Format> void _emit(results_t *results, EventRecord event, Format format);
+  Stamp _stamp() { return Stamp{ ++sequence, TscClock::now() }; }
+  void _record(FlightEvent event, char detail, OrderId oid, SymbolId symbolId=FlightRecorder::NO_SYMBOL,
+               Quantity qty=0, Price px=0) {
+    flight.record(actionStamp, event, detail, oid, symbolId, qty, px);
+  }
+  void _l3Add(const Order &order) {
+    if (!l3) return;
+    L3Event event = {};
+    event.type = 'A';
+    event.side = static_cast<char>(order.side);
+    order.symbol.copy(event.symbol, sizeof(event.symbol));
+    _l3Publish(event, order.oid, order.qty, order.px);
+  }
+  void _l3Change(char type, OrderId oid, Quantity qty=0, Price px=0, OrderId newOid=0) {
+    if (!l3) return;
+    L3Event event = {};
+    event.type = type;
+    event.newOid = newOid;
+    _l3Publish(event, oid, qty, px);
+  }
+  void _dropCopy(const Order &aggressor, const Fill &fill, size_t match) {
+    if (!dropCopy) return;
+    Execution execution = {};
+    execution.actionSeq = actionStamp.seq;
+    execution.ns = actionStamp.ns;
+    execution.pxTicks = JournalFormat::toTicks(fill.px);
+    execution.buyOid = aggressor.side == Side::BUY ? aggressor.oid : fill.oid;
+    execution.sellOid = aggressor.side == Side::BUY ? fill.oid : aggressor.oid;
+    execution.match = static_cast<uint32_t>(match);
+    execution.qty = fill.qty;
+    execution.aggressor = static_cast<char>(aggressor.side);
+    fill.symbol.copy(execution.symbol, sizeof(execution.symbol));
+    dropCopy->publish(execution);
+  }
+  void _l3Publish(L3Event &event, OrderId oid, Quantity qty, Price px) {
+    event.ns = actionStamp.ns;
+    event.oid = oid;
+    event.qty = qty;
+    event.pxTicks = px != 0 ? JournalFormat::toTicks(px) : 0;
+    l3->publish(event);
+  }
+
+  // An order and the neighbours its links point at, after it joined or left its queue
+  void _imageLinks(OrderHandle handle, bool resting) {
+    const RestingOrder& order = orderPool[handle];
+    image->store(handle, order, resting);
+    if (order.prev != NO_ORDER) image->store(order.prev, orderPool[order.prev]);
+    if (order.next != NO_ORDER) image->store(order.next, orderPool[order.next]);
+  }
+
+  SymbolId _findOrAddSymbol(const Symbol &symbol);
+  std::vector<SymbolId> _sortedSymbols();
+  void _restOrder(SymbolId symbolId, Order &order) { _restOrder(symbolId, order, orderPool.acquire()); }
+  void _restOrder(SymbolId symbolId, Order &order, OrderHandle handle);
+  void _refreshBest(SymbolId symbolId, Side side);
+  void _reclaimLevels(SymbolId symbolId, Side side);
+  void _fillOrder(SymbolId symbolId, Order &order, std::vector<Fill> &fills);
+  void _fillBid(SymbolId symbolId, Order &order, std::vector<Fill> &fills);
+  void _fillAsk(SymbolId symbolId, Order &order, std::vector<Fill> &fills);
+  bool _validateOrderId(const OrderId orderId);
+
+  const std::vector<std::string>& _splitLine(const std::string &line, const char delim=' ');
+  static bool _validSymbol(const std::string &symbol);
+  template<typename T> static bool _parseNumber(const std::string &field, T &value);
+
+  // Arguments are built before the debug check, so hot paths test debug themselves before concatenating
+  template<typename T> void _log(T t) { if (debug) { log(t); } }
+  void _logSortedBook();
+
+private:
+  // Empty levels per side tolerated before a bulk reclaim, see BookHot
+  static constexpr uint32_t LEVEL_RECLAIM_MIN = 64;
+  // Floor on the spare OID index pages kept ready by warmUp
+  static constexpr size_t WARM_INDEX_PAGES = 4;
+  // Fills per action warmUp makes room for; a larger sweep grows the buffer once
+  static constexpr size_t WARM_FILLS = 1024;
+  // OID SYMBOL SIDE QTY PX
+  static constexpr size_t ORDER_FIELDS = 5;
+  // Cancels in flight in applyBatch: enough to cover a DRAM miss with the work of the others, few enough that the
+  // prefetched lines are still in L1 when each cancel runs
+  static constexpr size_t CANCEL_GROUP = 16;
+
+  SymbolIds symbolIds;
+  std::vector<BookHot<Levels>> hotBooks;
+  std::vector<std::unique_ptr<BookCold<Levels>>> coldBooks;
+  OrderPool orderPool;
+  OrderIndex orderIndex;
+  uint64_t bookHash = 0; // XOR of every symbol's BookHot::hash
+
+  JournalWriter* journal = nullptr;
+  JournalWriter* replica = nullptr;
+  uint64_t replicaCheckpointEvery = DEFAULT_CHECKPOINT_EVERY;
+  uint64_t replicated = 0; // actions streamed to the replica
+
+  uint64_t sequence = 0;
+  Stamp actionStamp; // inbound action being processed
+  bool stampResults = false;
+  std::ostream* eventLog = nullptr;
+  L3Feed* l3 = nullptr;
+  DropCopy* dropCopy = nullptr;
+  BookImage* image = nullptr;
+
+  FlightRecorder flight;
+  EngineStats stats;
+  std::vector<Fill> actionFills; // current action's fills, kept to reuse its capacity
+  std::vector<std::string> lineFields; // current text action's fields, likewise
+  
+  bool debug = false;
+};
+
+typedef BasicSimpleCross<MapLevels> SimpleCross;
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+results_t BasicSimpleCross<Levels>::action(const std::string line) {
+  results_t results;
+  actionStamp = _stamp();
+  const std::vector<std::string>& instructions = _splitLine(line);
+  if (instructions.empty() || instructions[0].empty() || instructions[0][0] == '\r') return results;
+
+  Action action = static_cast<Action>(instructions[0][0]);
+  Order order;
+  QuoteFields quote;
+  RejectReason reason = _parseAction(instructions, action, order, quote);
+  if (action == Action::BULK) {
+    _bulk(instructions, &results);
+  } else if (reason != RejectReason::NONE) {
+    _reject(reason, action, order.oid, &results);
+  } else {
+    // Journaled before it is applied, as matching consumes order.qty; a rejected action rejects again on replay. The
+    // journal is group committed (see JournalWriter), so this doesn't make the action durable before its results
+    _journal(action, order, quote);
+    _record(FlightEvent::ACTION, static_cast<char>(action), order.oid, FlightRecorder::NO_SYMBOL, order.qty, order.px);
+    _apply(action, order, &results, quote);
+    _checkpoint();
+  }
+  if (dropCopy) dropCopy->retryOverflow();
+
+  if (debug) _logSortedBook();
+
+  stats.latency.record(TscClock::now() - actionStamp.ns);
+  return results;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Parse the fields of an O, X, Q or M action into order (and quote). Every field is range checked here, so nothing past
+// this point has to validate input. OID is parsed first so a reject can still name the order.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+RejectReason BasicSimpleCross<Levels>::_parseAction(const std::vector<std::string> &fields, Action action,
+                                                    Order &order, QuoteFields &quote) {
+  if (action == Action::PLACE) return _parseOrder(fields, 1, order);
+  if (action == Action::QUOTE) return _parseQuote(fields, order, quote);
+  if (action == Action::HASH) {
+    // The symbol is optional, a lone carriage return is the end of a CRLF line
+    if (fields.size() < 2 || fields[1].empty() || fields[1] == "\r") return RejectReason::NONE;
+    std::string symbol = fields[1].back() == '\r' ? fields[1].substr(0, fields[1].size() - 1) : fields[1];
+    if (!_validSymbol(symbol)) return RejectReason::BAD_SYMBOL;
+    order.symbol = symbol;
+    return RejectReason::NONE;
+  }
+  if (action != Action::CANCEL && action != Action::QUEUE) return RejectReason::NONE;
+  if (fields.size() < 2 || !_parseNumber(fields[1], order.oid)) return RejectReason::MALFORMED;
+  return RejectReason::NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// OID SYMBOL SIDE QTY PX starting at fields[first], the body of an O action and of each order in a B action
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+RejectReason BasicSimpleCross<Levels>::_parseOrder(const std::vector<std::string> &fields, size_t first,
+                                                   Order &order) {
+  if (fields.size() <= first || !_parseNumber(fields[first], order.oid)) return RejectReason::MALFORMED;
+  if (fields.size() < first + ORDER_FIELDS) return RejectReason::MALFORMED;
+
+  if (!_validSymbol(fields[first + 1])) return RejectReason::BAD_SYMBOL;
+  order.symbol = fields[first + 1];
+
+  const std::string& side = fields[first + 2];
+  if (side.size() != 1 || (side[0] != Side::BUY && side[0] != Side::SELL)) return RejectReason::BAD_SIDE;
+  order.side = static_cast<Side>(side[0]);
+
+  uint32_t qty;
+  if (!_parseNumber(fields[first + 3], qty)) return RejectReason::MALFORMED;
+  if (qty == 0 || qty > std::numeric_limits<Quantity>::max()) return RejectReason::BAD_QUANTITY;
+  order.qty = static_cast<Quantity>(qty);
+
+  if (!_parseNumber(fields[first + 4], order.px)) return RejectReason::MALFORMED;
+  if (!JournalFormat::onGrid(order.px)) return RejectReason::BAD_PRICE;
+
+  return RejectReason::NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// M PID SYMBOL BID_OID BID_QTY BID_PX ASK_OID ASK_QTY ASK_PX. The OID and price of a side with qty 0 are ignored, the
+// price is cleared so the journal never encodes it. Whether the OIDs are free depends on the maker's current quote and
+// is checked by _quote().
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+RejectReason BasicSimpleCross<Levels>::_parseQuote(const std::vector<std::string> &fields, Order &bid,
+                                                   QuoteFields &quote) {
+  if (fields.size() < 4 || !_parseNumber(fields[3], bid.oid)) return RejectReason::MALFORMED;
+  if (fields.size() < 9 || !_parseNumber(fields[1], quote.pid) || quote.pid == 0) return RejectReason::MALFORMED;
+
+  if (!_validSymbol(fields[2])) return RejectReason::BAD_SYMBOL;
+  bid.symbol = fields[2];
+  bid.side = Side::BUY;
+
+  uint32_t bidQty, askQty;
+  if (!_parseNumber(fields[4], bidQty) || !_parseNumber(fields[5], bid.px)) return RejectReason::MALFORMED;
+  if (!_parseNumber(fields[6], quote.askOid) || !_parseNumber(fields[7], askQty)
+      || !_parseNumber(fields[8], quote.askPx)) {
+    return RejectReason::MALFORMED;
+  }
+  if (bidQty > std::numeric_limits<Quantity>::max() || askQty > std::numeric_limits<Quantity>::max()) {
+    return RejectReason::BAD_QUANTITY;
+  }
+  bid.qty = static_cast<Quantity>(bidQty);
+  quote.askQty = static_cast<Quantity>(askQty);
+
+  // OID 0 marks an empty side in the maker's quote table
+  if ((bid.qty != 0 && bid.oid == 0) || (quote.askQty != 0 && quote.askOid == 0)) return RejectReason::MALFORMED;
+
+  for (Price* px : { &bid.px, &quote.askPx }) {
+    bool quoted = px == &bid.px ? bid.qty != 0 : quote.askQty != 0;
+    if (!quoted) {
+      *px = 0;
+    } else if (!JournalFormat::onGrid(*px)) {
+      return RejectReason::BAD_PRICE;
+    }
+  }
+  if (bid.qty != 0 && quote.askQty != 0) {
+    if (bid.px >= quote.askPx) return RejectReason::BAD_PRICE;
+    if (bid.oid == quote.askOid) return RejectReason::DUPLICATE_OID;
+  }
+
+  return RejectReason::NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::_validSymbol(const std::string &symbol) {
+  const size_t MAX_SYMBOL_LENGTH = 8;
+
+  return !symbol.empty() && symbol.size() <= MAX_SYMBOL_LENGTH
+    && std::all_of(symbol.begin(), symbol.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)); });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Each order of a B action is its own inbound action: it takes the next sequence number (sharing the line's receive
+// time), is journaled and recorded as a place, and rejects on its own. Only the split, the dispatch and the results
+// container are shared.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_bulk(const std::vector<std::string> &fields, results_t *results) {
+  stats.bulks++;
+  if (fields.size() < 2) {
+    _reject(RejectReason::MALFORMED, Action::BULK, 0, results);
+    return;
+  }
+
+  for (size_t first = 1; first < fields.size(); first += ORDER_FIELDS) {
+    if (first != 1) actionStamp = Stamp{ ++sequence, actionStamp.ns };
+
+    Order order;
+    RejectReason reason = _parseOrder(fields, first, order);
+    if (reason != RejectReason::NONE) {
+      _reject(reason, Action::PLACE, order.oid, results);
+      continue;
+    }
+    _journal(Action::PLACE, order);
+    _record(FlightEvent::ACTION, static_cast<char>(Action::PLACE), order.oid, FlightRecorder::NO_SYMBOL, order.qty,
+            order.px);
+    _apply(Action::PLACE, order, results);
+    _checkpoint();
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// from_chars over the whole field, ignoring the trailing carriage return of CRLF input
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+template<typename T>
+bool BasicSimpleCross<Levels>::_parseNumber(const std::string &field, T &value) {
+  const char* begin = field.data();
+  const char* end = begin + field.size();
+  if (end != begin && end[-1] == '\r') end--;
+  auto [ptr, ec] = std::from_chars(begin, end, value);
+  return ec == std::errc() && ptr == end && ptr != begin;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_apply(Action action, Order &order, results_t *results, const QuoteFields &quote) {
+  RejectReason reason = RejectReason::NONE;
+  OrderId rejectOid = order.oid;
+
+  if (action == Action::PLACE) {
+    stats.places++;
+    actionFills.clear();
+    if (_placeOrder(order, actionFills)) {
+      _printFills(actionFills, results);
+    } else {
+      reason = RejectReason::DUPLICATE_OID;
+    }
+  } else if (action == Action::CANCEL) {
+    stats.cancels++;
+    if (_cancelOrder(order.oid)) {
+      _printCancel(order.oid, results);
+    } else {
+      reason = RejectReason::UNKNOWN_OID;
+    }
+  } else if (action == Action::PRINT) {
+    stats.prints++;
+    _printSortedBook(results);
+  } else if (action == Action::STATS) {
+    stats.queries++;
+    _printStats(results);
+  } else if (action == Action::QUEUE) {
+    stats.positions++;
+    if (!_printPosition(order.oid, results)) reason = RejectReason::UNKNOWN_OID;
+  } else if (action == Action::HASH) {
+    stats.hashes++;
+    _printHash(order.symbol, results);
+  } else if (action == Action::QUOTE) {
+    stats.quotes++;
+    actionFills.clear();
+    reason = _quote(order, quote, actionFills, rejectOid);
+    if (reason == RejectReason::NONE) _printFills(actionFills, results);
+  } else {
+    reason = RejectReason::UNKNOWN_ACTION;
+  }
+
+  if (reason != RejectReason::NONE) _reject(reason, action, rejectOid, results);
+  if (image) image->commit(actionStamp.seq, sequence, bookHash);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::applyBatch(ActionRecord* records, size_t count) {
+  for (size_t i = 0; i < count;) {
+    size_t end = i;
+    while (end < count && end - i < CANCEL_GROUP && records[end].action == Action::CANCEL) end++;
+    if (end - i > 1) {
+      _cancelGroup(records + i, end - i);
+      i = end;
+    } else {
+      apply(records[i++]);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Group prefetch: each stage issues its prefetch for every cancel of the group before the next stage reads what the
+// previous one fetched, so the group's misses at each level of the chain (OID table, index page, resting order, then
+// its level and queue neighbours) are in flight together. The cancels then run as usual, hitting cache. Prefetches
+// are only hints, so a cancel changing what a later one would touch costs a miss, never a wrong result.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_cancelGroup(ActionRecord* records, size_t count) {
+  OrderHandle handles[CANCEL_GROUP];
+
+  for (size_t i = 0; i < count; i++) orderIndex.prefetchTable(records[i].order.oid);
+  for (size_t i = 0; i < count; i++) orderIndex.prefetchHandle(records[i].order.oid);
+  for (size_t i = 0; i < count; i++) {
+    handles[i] = orderIndex.find(records[i].order.oid);
+    orderPool.prefetch(handles[i]);
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (handles[i] == NO_ORDER) continue;
+    const RestingOrder& resting = orderPool[handles[i]];
+    __builtin_prefetch(resting.queue, 1);
+    __builtin_prefetch(&hotBooks[resting.symbolId], 1);
+    orderPool.prefetch(resting.prev);
+    orderPool.prefetch(resting.next);
+  }
+
+  for (size_t i = 0; i < count; i++) apply(records[i]);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::writeSnapshot(std::ostream& out) {
+  // Resting orders in time priority within each level, so restoring them in file order rebuilds identical queues
+  JournalWriter writer(out, JournalBlock::SNAPSHOT);
+  for (SymbolId symbolId : _sortedSymbols()) {
+    if (hotBooks[symbolId].orders == 0) continue;
+    const BookCold<Levels>& cold = *coldBooks[symbolId];
+    for (const PriceLevels* pxLevels : { &cold.bids, &cold.asks }) {
+      for (const std::pair<const Price, OrderQueue>& pxLevel : *pxLevels) {
+        for (OrderHandle handle = pxLevel.second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+          const RestingOrder& resting = orderPool[handle];
+          QuoteFields quote;
+          quote.pid = resting.owner;
+          writer.append(resting.owner != 0 ? Action::QUOTE : Action::PLACE, resting.order, Stamp(), quote);
+        }
+      }
+    }
+    // Checked by recovery once the symbol's orders are restored
+    writer.appendHash(cold.symbol, hotBooks[symbolId].hash);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+size_t BasicSimpleCross<Levels>::recover(std::istream& in, std::optional<uint64_t> imageSeq) {
+  JournalReader reader(in);
+  ActionRecord record;
+  size_t replayed = 0;
+
+  while (reader.next(record)) {
+    if (imageSeq && (reader.kind() == JournalBlock::SNAPSHOT || record.stamp.seq <= *imageSeq)) continue;
+    _replay(reader.kind(), record);
+    replayed++;
+  }
+
+  if (reader.corrupt()) {
+    _log("Journal ends in a torn or corrupt block, recovered " + std::to_string(replayed) + " records");
+  }
+
+  return replayed;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Recovery that never catches up: the stream is live, so each record is applied as soon as it is read and its lag
+// taken from the primary's receive time. Both processes calibrate their TSC clocks against CLOCK_REALTIME, so on one
+// machine the difference is good to about a microsecond.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+size_t BasicSimpleCross<Levels>::follow(std::istream& in) {
+  JournalReader reader(in);
+  ActionRecord record;
+  size_t applied = 0;
+
+  while (reader.next(record)) {
+    _replay(reader.kind(), record);
+    uint64_t now = TscClock::now();
+    if (record.action != Action::HASH && record.stamp.ns != 0) {
+      stats.lag.record(now > record.stamp.ns ? now - record.stamp.ns : 0);
+    }
+    applied++;
+  }
+
+  if (reader.corrupt()) {
+    _log("Replication stream ends in a torn or corrupt block, applied " + std::to_string(applied) + " records");
+  }
+
+  return applied;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Restoring puts every order back at its own handle, level by level from the head of each chain, so the pool, the
+// queues and the image agree slot for slot and the image carries on from where it was without a rewrite.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::attachImage(BookImage& source) {
+  if (source.empty()) {
+    for (SymbolId symbolId = 0; symbolId < hotBooks.size(); symbolId++) source.addSymbol(coldBooks[symbolId]->symbol);
+    for (SymbolId symbolId = 0; symbolId < hotBooks.size(); symbolId++) {
+      const BookCold<Levels>& cold = *coldBooks[symbolId];
+      for (const PriceLevels* pxLevels : { &cold.bids, &cold.asks }) {
+        for (const std::pair<const Price, OrderQueue>& pxLevel : *pxLevels) {
+          for (OrderHandle handle = pxLevel.second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+            source.store(handle, orderPool[handle]);
+          }
+        }
+      }
+    }
+    source.commit(sequence, sequence, bookHash);
+    image = &source;
+    return true;
+  }
+
+  if (!hotBooks.empty() || !source.consistent()) return false;
+  for (SymbolId symbolId = 0; symbolId < source.symbols(); symbolId++) _findOrAddSymbol(source.symbol(symbolId));
+  if (hotBooks.size() != source.symbols()) return false;
+
+  orderPool.adopt(source.handles(), [&](OrderHandle handle) { return source.slot(handle).resting != 0; });
+  for (OrderHandle head = 0; head < source.handles(); head++) {
+    if (!source.slot(head).resting || source.slot(head).prev != NO_ORDER) continue;
+    for (OrderHandle handle = head; handle != NO_ORDER; handle = source.slot(handle).next) {
+      const BookImage::Slot& slot = source.slot(handle);
+      if (!_validateOrderId(slot.oid)) return false;
+      Order order(slot.oid, coldBooks[slot.symbolId]->symbol, static_cast<Side>(slot.side), slot.qty, slot.px);
+      _restOrder(slot.symbolId, order, handle);
+      if (slot.owner != 0) _adoptQuote(slot.owner, slot.oid);
+    }
+  }
+
+  sequence = source.sequence();
+  if (bookHash != source.bookHash()) {
+    stats.hashMismatches++;
+    _log("Book hash mismatch restoring the book image");
+  }
+  image = &source;
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_replay(JournalBlock kind, ActionRecord& record) {
+  if (record.action == Action::HASH) {
+    _verifyHash(record.order.symbol, record.hash);
+  } else if (kind == JournalBlock::SNAPSHOT) {
+    _restOrder(record.order);
+    if (record.action == Action::QUOTE) _adoptQuote(record.quote.pid, record.order.oid);
+  } else {
+    // Replayed events take the same sequence numbers they had originally
+    if (record.stamp.seq != 0) sequence = record.stamp.seq;
+    actionStamp = Stamp{ sequence, record.stamp.ns };
+    _apply(record.action, record.order, nullptr, record.quote);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Symbols never interact, so recovery splits the journal into per-symbol streams and replays them concurrently on
+// scratch engines whose books are then spliced into this one. Cancels and snapshot entries only matter to the symbol
+// of the order they refer to, which a pre-pass resolves while decoding; prints and cancels of unknown OIDs have no
+// effect on state and are dropped.
+//
+// Replaying one symbol at a time is equivalent to the interleaved sequence unless an OID is reused across symbols,
+// since duplicate detection would then depend on another symbol's matching. In that case, or when this engine already
+// holds state, the stream is rewound and replayed sequentially (so it must be seekable).
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+size_t BasicSimpleCross<Levels>::recoverParallel(std::istream& in, unsigned threads) {
+  if (threads <= 1 || !hotBooks.empty()) return recover(in);
+
+  std::istream::pos_type start = in.tellg();
+  JournalReader reader(in);
+  ActionRecord record;
+  size_t records = 0;
+  uint64_t lastSeq = 0;
+  bool crossSymbolOid = false;
+
+  std::vector<Symbol> symbols;
+  std::unordered_map<Symbol, uint32_t> symbolIds;
+  std::unordered_map<OrderId, uint32_t> oidSymbols;
+  std::vector<std::vector<ReplayEntry>> bySymbol;
+
+  while (reader.next(record)) {
+    records++;
+    lastSeq = std::max(lastSeq, record.stamp.seq);
+    const Order& order = record.order;
+    bool snapshot = reader.kind() == JournalBlock::SNAPSHOT;
+    uint32_t symbolId;
+
+    // Snapshot book hashes go to their symbol's partition too, checked by the worker once it has restored the book.
+    // Replication checkpoints span every book, so they are dropped with the other records no partition needs
+    if (snapshot || record.action == Action::PLACE || record.action == Action::QUOTE) {
+      auto it = symbolIds.find(order.symbol);
+      if (it == symbolIds.end()) {
+        symbolId = static_cast<uint32_t>(symbols.size());
+        symbolIds.emplace(order.symbol, symbolId);
+        symbols.push_back(order.symbol);
+        bySymbol.emplace_back();
+      } else {
+        symbolId = it->second;
+      }
+
+      // A quote's OIDs belong to its symbol for as long as the sides are quoted
+      bool hasOid = record.action == Action::QUOTE && !snapshot ? order.qty != 0 : record.action != Action::HASH;
+      if (hasOid) {
+        auto oidIt = oidSymbols.emplace(order.oid, symbolId).first;
+        if (oidIt->second != symbolId) crossSymbolOid = true;
+      }
+      if (record.action == Action::QUOTE && !snapshot && record.quote.askQty != 0) {
+        auto oidIt = oidSymbols.emplace(record.quote.askOid, symbolId).first;
+        if (oidIt->second != symbolId) crossSymbolOid = true;
+      }
+    } else if (record.action == Action::CANCEL) {
+      auto oidIt = oidSymbols.find(order.oid);
+      if (oidIt == oidSymbols.end()) continue;
+      symbolId = oidIt->second;
+    } else {
+      continue;
+    }
+
+    bySymbol[symbolId].push_back(ReplayEntry{
+      record.stamp.seq, order.oid, order.px, order.qty, record.action, order.side, snapshot, record.quote, record.hash
+    });
+  }
+
+  if (reader.corrupt()) {
+    _log("Journal ends in a torn or corrupt block, recovered " + std::to_string(records) + " records");
+  }
+
+  if (crossSymbolOid) {
+    _log("OID reused across symbols, replaying sequentially");
+    in.clear();
+    in.seekg(start);
+    return recover(in);
+  }
+
+  // Longest partitions first, each to the least loaded worker
+  std::vector<uint32_t> bySize(symbols.size());
+  for (uint32_t i = 0; i < bySize.size(); i++) bySize[i] = i;
+  std::sort(bySize.begin(), bySize.end(), [&](uint32_t a, uint32_t b) {
+    return bySymbol[a].size() > bySymbol[b].size();
+  });
+
+  threads = std::min<unsigned>(threads, std::max<size_t>(symbols.size(), 1));
+  std::vector<std::vector<uint32_t>> assignments(threads);
+  std::vector<size_t> loads(threads, 0);
+  for (uint32_t symbolId : bySize) {
+    size_t worker = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    assignments[worker].push_back(symbolId);
+    loads[worker] += bySymbol[symbolId].size();
+  }
+
+  std::vector<BasicSimpleCross> engines(threads);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (uint32_t symbolId : assignments[t]) engines[t]._replaySymbol(bySymbol[symbolId], symbols[symbolId]);
+    });
+  }
+  for (std::thread& worker : workers) worker.join();
+
+  // Orders are addressed by handles into each engine's own pool, so the resulting books are restored here in priority
+  // order, which costs time proportional to the book rather than the journal
+  for (BasicSimpleCross& engine : engines) {
+    for (SymbolId symbolId = 0; symbolId < engine.hotBooks.size(); symbolId++) {
+      const BookCold<Levels>& cold = *engine.coldBooks[symbolId];
+      SymbolId restored = _findOrAddSymbol(cold.symbol);
+      for (const PriceLevels* pxLevels : { &cold.bids, &cold.asks }) {
+        for (const std::pair<const Price, OrderQueue>& pxLevel : *pxLevels) {
+          for (OrderHandle handle = pxLevel.second.head; handle != NO_ORDER; handle = engine.orderPool[handle].next) {
+            Order order = engine.orderPool[handle].order;
+            _restOrder(restored, order);
+            if (engine.orderPool[handle].owner != 0) _adoptQuote(engine.orderPool[handle].owner, order.oid);
+          }
+        }
+      }
+      coldBooks[restored]->stats = cold.stats;
+    }
+    orderIndex.mergeSeen(engine.orderIndex);
+    sequence = std::max(sequence, engine.sequence);
+    stats.merge(engine.stats);
+  }
+
+  // Exact unless the journal ends in records dropped above (cancels of unknown OIDs), whose events then renumber
+  sequence = std::max(sequence, lastSeq);
+
+  return records;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_replaySymbol(const std::vector<ReplayEntry>& entries, const Symbol& symbol) {
+  for (const ReplayEntry& entry : entries) {
+    Order order;
+    order.oid = entry.oid;
+    order.symbol = symbol;
+    order.side = entry.side;
+    order.qty = entry.qty;
+    order.px = entry.px;
+
+    if (entry.snapshot && entry.action == Action::HASH) {
+      _verifyHash(symbol, entry.hash);
+      continue;
+    } else if (entry.snapshot) {
+      _restOrder(order);
+      if (entry.action == Action::QUOTE) _adoptQuote(entry.quote.pid, order.oid);
+      continue;
+    }
+
+    if (entry.seq != 0) sequence = entry.seq;
+    _apply(entry.action, order, nullptr, entry.quote);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::warmUp(size_t orders, size_t syntheticActions) {
+  // Level nodes are the only arena users left, a few per order is plenty
+  NodeArena::local().prefault(orders * 16);
+  orderPool.reserve(orders);
+  orderIndex.reserve(std::max(WARM_INDEX_PAGES, orders / OrderIndex::PAGE_ORDERS));
+  actionFills.reserve(WARM_FILLS);
+
+  // The scratch engine's nodes land on this thread's free lists when it goes out of scope
+  BasicSimpleCross scratch;
+  SyntheticFlow flow;
+  for (size_t i = 0; i < syntheticActions; i++) {
+    ActionRecord record = flow.next();
+    scratch.apply(record);
+  }
+
+  _log("Warmed up: " + std::to_string(NodeArena::local().reservedBytes() >> 20) + "MB arena, "
+    + std::to_string(syntheticActions) + " synthetic actions");
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Add an order to the book without attempting to cross it (snapshot restore)
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_restOrder(Order &order) {
+  _restOrder(_findOrAddSymbol(order.symbol), order);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::_placeOrder(Order &order, std::vector<Fill> &fills, bool oidChecked) {
+  if (!oidChecked && !_validateOrderId(order.oid)) return false;
+
+  // Note: In a real system, all the traded symbols would probably be loaded on startup,
+  //       but given the problem constraints, we will generate the book on the fly
+  SymbolId symbolId = _findOrAddSymbol(order.symbol);
+  const BookHot<Levels>& hot = hotBooks[symbolId];
+
+  // Most orders don't cross. The hot header's best opposite price settles that without touching the symbol's depth
+  bool crosses = order.side == Side::BUY ? order.px >= hot.bestAsk : order.px <= hot.bestBid;
+  if (crosses) [[unlikely]] {
+    _fillOrder(symbolId, order, fills);
+  }
+
+  if (order.qty != 0) [[likely]] { // order was not completely filled
+    _restOrder(symbolId, order);
+  }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+SymbolId BasicSimpleCross<Levels>::_findOrAddSymbol(const Symbol &symbol) {
+  auto it = symbolIds.find(symbol);
+  if (it != symbolIds.end()) return it->second;
+
+  _log("Symbol " + symbol + " not in book. Adding it now.");
+  SymbolId symbolId = static_cast<SymbolId>(hotBooks.size());
+  symbolIds.emplace(symbol, symbolId);
+  hotBooks.emplace_back();
+  coldBooks.emplace_back(std::make_unique<BookCold<Levels>>());
+  coldBooks.back()->symbol = symbol;
+  hotBooks.back().seed = BookHash::seed(symbol);
+  flight.nameSymbol(symbolId, symbol);
+  if (image) image->addSymbol(symbol);
+  return symbolId;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+std::vector<SymbolId> BasicSimpleCross<Levels>::_sortedSymbols() {
+  std::vector<SymbolId> sorted(hotBooks.size());
+  for (SymbolId symbolId = 0; symbolId < sorted.size(); symbolId++) sorted[symbolId] = symbolId;
+  std::sort(sorted.begin(), sorted.end(), [&](SymbolId a, SymbolId b) {
+    return coldBooks[a]->symbol < coldBooks[b]->symbol;
+  });
+  return sorted;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_restOrder(SymbolId symbolId, Order &order, OrderHandle handle) {
+  BookHot<Levels>& hot = hotBooks[symbolId];
+  bool buy = order.side == Side::BUY;
+  bool sideEmpty = (buy ? hot.bidLevels : hot.askLevels) == 0;
+  Price bestPx = buy ? hot.bestBid : hot.bestAsk; // sentinel if sideEmpty
+  hot.orders++;
+
+  RestingOrder& resting = orderPool[handle];
+  resting.order = order;
+  resting.symbolId = symbolId;
+  resting.owner = 0;
+  orderIndex.insert(order.oid, handle);
+  _record(FlightEvent::RESTED, static_cast<char>(order.side), order.oid, symbolId, order.qty, order.px);
+  _l3Add(order);
+
+  // Joining the best level goes through the hot header's level handle
+  if (order.px == bestPx) {
+    resting.queue = &(buy ? hot.bestBidLevel : hot.bestAskLevel)->second;
+    _linkOrder(*resting.queue, handle);
+    return;
+  }
+
+  // A new best level sits right next to the old best unless emptied levels lie between, so hint the insert there
+  BookCold<Levels>& cold = *coldBooks[symbolId];
+  PriceLevels& pxLevels = buy ? cold.bids : cold.asks;
+  bool improves = buy ? order.px > bestPx : order.px < bestPx;
+  size_t levels = pxLevels.size();
+  typename PriceLevels::iterator pxLevelIt;
+  if (improves && !sideEmpty) {
+    pxLevelIt = pxLevels.try_emplace(buy ? std::next(hot.bestBidLevel) : hot.bestAskLevel, order.px);
+  } else {
+    pxLevelIt = pxLevels.try_emplace(order.px).first;
+  }
+  bool inserted = pxLevels.size() != levels;
+  OrderQueue& orderQueue = pxLevelIt->second;
+
+  if (inserted) {
+    (buy ? hot.bidLevels : hot.askLevels)++;
+    cold.stats.levelsCreated++;
+    _record(FlightEvent::LEVEL_CREATED, static_cast<char>(order.side), order.oid, symbolId, 0, order.px);
+  } else if (orderQueue.empty()) {
+    (buy ? hot.bidLevels : hot.askLevels)++;
+    (buy ? cold.emptyBidLevels : cold.emptyAskLevels)--;
+    cold.stats.levelsReused++;
+  }
+  resting.queue = &orderQueue;
+  _linkOrder(orderQueue, handle);
+
+  if (improves) {
+    (buy ? hot.bestBid : hot.bestAsk) = order.px;
+    (buy ? hot.bestBidLevel : hot.bestAskLevel) = pxLevelIt;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Move the best level handle past levels that emptied out. Everything better than the old best is already empty, so
+// the new best is the first live level behind it. Must run before those levels are reclaimed.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_refreshBest(SymbolId symbolId, Side side) {
+  BookHot<Levels>& hot = hotBooks[symbolId];
+
+  if (side == Side::BUY) {
+    if (hot.bidLevels == 0) {
+      hot.bestBid = -std::numeric_limits<Price>::infinity();
+      return;
+    }
+    while (hot.bestBidLevel->second.empty()) --hot.bestBidLevel;
+    hot.bestBid = hot.bestBidLevel->first;
+  } else {
+    if (hot.askLevels == 0) {
+      hot.bestAsk = std::numeric_limits<Price>::infinity();
+      return;
+    }
+    while (hot.bestAskLevel->second.empty()) ++hot.bestAskLevel;
+    hot.bestAsk = hot.bestAskLevel->first;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_reclaimLevels(SymbolId symbolId, Side side) {
+  BookCold<Levels>& cold = *coldBooks[symbolId];
+  uint32_t& emptyLevels = side == Side::BUY ? cold.emptyBidLevels : cold.emptyAskLevels;
+  uint32_t liveLevels = side == Side::BUY ? hotBooks[symbolId].bidLevels : hotBooks[symbolId].askLevels;
+  if (emptyLevels < LEVEL_RECLAIM_MIN || emptyLevels < liveLevels) return;
+
+  if (debug) _log("Reclaiming " + std::to_string(emptyLevels) + " empty levels from " + cold.symbol);
+  _record(FlightEvent::LEVELS_RECLAIMED, static_cast<char>(side), emptyLevels, symbolId);
+  erase_if(side == Side::BUY ? cold.bids : cold.asks, [](const std::pair<const Price, OrderQueue>& pxLevel) {
+    return pxLevel.second.empty();
+  });
+  cold.stats.levelsReclaimed += emptyLevels;
+  emptyLevels = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::_cancelOrder(OrderId oid) {
+  if (debug) _log("Cancelling order: " + std::to_string(oid));
+
+  OrderHandle handle = orderIndex.find(oid);
+  if (handle == NO_ORDER) return false;
+
+  RestingOrder& resting = orderPool[handle];
+  SymbolId symbolId = resting.symbolId;
+  Side side = resting.order.side;
+  OrderQueue& orderQueue = *resting.queue;
+  Price px = resting.order.px;
+  BookHot<Levels>& hot = hotBooks[symbolId];
+
+  if (resting.owner != 0) [[unlikely]] _forgetQuote(resting);
+  _unlinkOrder(orderQueue, handle);
+  orderPool.release(handle);
+  orderIndex.erase(oid);
+  hot.orders--;
+  _record(FlightEvent::CANCELLED, static_cast<char>(side), oid, symbolId, 0, px);
+  _l3Change('D', oid);
+
+  if (orderQueue.empty()) {
+    // Leave the level allocated, see BookHot
+    BookCold<Levels>& cold = *coldBooks[symbolId];
+    bool wasBest = &orderQueue == &(side == Side::BUY ? hot.bestBidLevel : hot.bestAskLevel)->second;
+    _record(FlightEvent::LEVEL_EMPTIED, static_cast<char>(side), oid, symbolId, 0, px);
+    (side == Side::BUY ? hot.bidLevels : hot.askLevels)--;
+    (side == Side::BUY ? cold.emptyBidLevels : cold.emptyAskLevels)++;
+    if (wasBest) _refreshBest(symbolId, side);
+    _reclaimLevels(symbolId, side);
+  }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Replace a market maker's quote in one symbol. Sides that move or are pulled are cancelled before anything is placed,
+// so a new bid can't cross the maker's own stale ask or the reverse. A side requoted at its resting price is updated in
+// place and keeps its pool slot, level and (unless it grows) queue position, which is most of a quoting flow.
+// Everything that can reject is checked before the book changes, and rejectOid is set to the OID of the failing side.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+RejectReason BasicSimpleCross<Levels>::_quote(Order &bid, const QuoteFields &quote, std::vector<Fill> &fills,
+                                              OrderId &rejectOid) {
+  Order ask(quote.askOid, bid.symbol, Side::SELL, quote.askQty, quote.askPx);
+  SymbolId symbolId = _findOrAddSymbol(bid.symbol);
+  std::unordered_map<uint32_t, QuoteOrders>& quotes = coldBooks[symbolId]->quotes;
+  auto found = quotes.find(quote.pid);
+  QuoteOrders previous = found != quotes.end() ? found->second : QuoteOrders();
+
+  // A side's OID must never have been used unless it is the one that side rests under now, which it keeps if it moves
+  if (bid.qty != 0 && bid.oid != previous.bid && !_validateOrderId(bid.oid)) return RejectReason::DUPLICATE_OID;
+  if (ask.qty != 0 && ask.oid != previous.ask && !_validateOrderId(ask.oid)) {
+    rejectOid = ask.oid;
+    return RejectReason::DUPLICATE_OID;
+  }
+
+  Order* sides[] = { &bid, &ask };
+  OrderId resting[] = { previous.bid, previous.ask };
+  OrderHandle handles[] = { NO_ORDER, NO_ORDER };
+  for (int i = 0; i < 2; i++) {
+    if (resting[i] == 0) continue;
+    handles[i] = orderIndex.find(resting[i]);
+    if (sides[i]->qty == 0 || orderPool[handles[i]].order.px != sides[i]->px) {
+      _cancelOrder(resting[i]);
+      handles[i] = NO_ORDER;
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    Order& order = *sides[i];
+    if (handles[i] != NO_ORDER) {
+      _requote(handles[i], order);
+      if (order.oid != resting[i]) _adoptQuote(quote.pid, order.oid);
+    } else if (order.qty != 0) {
+      _placeOrder(order, fills, true);
+      if (order.qty != 0) _adoptQuote(quote.pid, order.oid);
+    }
+  }
+
+  // Entries emptied by fills linger until the maker's next quote
+  if (bid.qty == 0 || ask.qty == 0) {
+    found = quotes.find(quote.pid);
+    if (found != quotes.end() && found->second.bid == 0 && found->second.ask == 0) quotes.erase(found);
+  }
+  return RejectReason::NONE;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Give a resting quote order a new OID and qty at its price. Less size keeps its place in the queue, more goes to the
+// back of the level as a cancel and replace would.
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_requote(OrderHandle handle, const Order &order) {
+  RestingOrder& resting = orderPool[handle];
+  OrderId oldOid = resting.order.oid;
+  Quantity oldQty = resting.order.qty;
+  if (order.oid != resting.order.oid) {
+    _toggleKeys(handle);
+    orderIndex.erase(resting.order.oid);
+    orderIndex.insert(order.oid, handle);
+    resting.order.oid = order.oid;
+    _toggleKeys(handle);
+    if (image) image->store(handle, resting);
+  }
+
+  if (order.qty <= resting.order.qty) {
+    _reduceOrder(*resting.queue, handle, resting.order.qty - order.qty);
+    if (order.oid != oldOid) {
+      _l3Change('U', oldOid, order.qty, 0, order.oid);
+    } else if (order.qty != oldQty) {
+      _l3Change('R', oldOid, oldQty - order.qty);
+    }
+  } else {
+    _unlinkOrder(*resting.queue, handle);
+    resting.order.qty = order.qty;
+    _linkOrder(*resting.queue, handle);
+    _l3Change('D', oldOid);
+    _l3Add(resting.order);
+  }
+  _record(FlightEvent::REQUOTED, static_cast<char>(order.side), order.oid, resting.symbolId, order.qty, order.px);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Mark a resting order as maker pid's quote on its side
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_adoptQuote(uint32_t pid, OrderId oid) {
+  OrderHandle handle = orderIndex.find(oid);
+  RestingOrder& resting = orderPool[handle];
+  uint64_t key = _orderKey(resting);
+  resting.owner = pid;
+  _toggleKey(resting.symbolId, key ^ _orderKey(resting));
+  if (image) image->store(handle, resting);
+  QuoteOrders& quoted = coldBooks[resting.symbolId]->quotes[pid];
+  (resting.order.side == Side::BUY ? quoted.bid : quoted.ask) = oid;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// A quote order is leaving the book (cancelled or filled), clear its side of the maker's quote
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_forgetQuote(const RestingOrder &resting) {
+  QuoteOrders& quoted = coldBooks[resting.symbolId]->quotes[resting.owner];
+  (resting.order.side == Side::BUY ? quoted.bid : quoted.ask) = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Book hash key of a resting order's fields, see BookHot. Nonlinear in all of them, so orders can't trade fields and
+// keep the hash; links are keyed separately by _linkKey
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+uint64_t BasicSimpleCross<Levels>::_orderKey(const RestingOrder &resting) {
+  const Order& order = resting.order;
+  uint64_t fields = static_cast<uint64_t>(order.oid) << 32 | static_cast<uint64_t>(order.qty) << 8
+    | static_cast<uint8_t>(order.side);
+  uint64_t key = hotBooks[resting.symbolId].seed ^ fields;
+  key = BookHash::mix(BookHash::mix(key) ^ std::bit_cast<uint64_t>(order.px));
+  if (resting.owner != 0) [[unlikely]] key ^= BookHash::mix(key ^ resting.owner);
+  return key;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Toggle every key an order's OID is part of: its own and its links to the orders queued either side of it
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_toggleKeys(OrderHandle handle) {
+  const RestingOrder& resting = orderPool[handle];
+  SymbolId symbolId = resting.symbolId;
+  _toggleKey(symbolId, _orderKey(resting));
+  if (resting.prev != NO_ORDER) {
+    _toggleKey(symbolId, _linkKey(symbolId, orderPool[resting.prev].order.oid, resting.order.oid));
+  }
+  if (resting.next != NO_ORDER) {
+    _toggleKey(symbolId, _linkKey(symbolId, resting.order.oid, orderPool[resting.next].order.oid));
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// OrderPool's queue operations with the book hash kept current
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_linkOrder(OrderQueue &queue, OrderHandle handle) {
+  orderPool.pushBack(queue, handle);
+  _toggleKeys(handle);
+  if (image) _imageLinks(handle, true);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_unlinkOrder(OrderQueue &queue, OrderHandle handle) {
+  const RestingOrder& resting = orderPool[handle];
+  _toggleKeys(handle);
+  if (resting.prev != NO_ORDER && resting.next != NO_ORDER) {
+    SymbolId symbolId = resting.symbolId;
+    _toggleKey(symbolId, _linkKey(symbolId, orderPool[resting.prev].order.oid, orderPool[resting.next].order.oid));
+  }
+  orderPool.unlink(queue, handle);
+  if (image) _imageLinks(handle, false);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_reduceOrder(OrderQueue &queue, OrderHandle handle, Quantity qty) {
+  const RestingOrder& resting = orderPool[handle];
+  uint64_t key = _orderKey(resting);
+  orderPool.reduce(queue, handle, qty);
+  _toggleKey(resting.symbolId, key ^ _orderKey(resting));
+  if (image) image->store(handle, resting);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_verifyHash(const Symbol &symbol, uint64_t expected) {
+  // No symbol is a checkpoint, over every book
+  if (symbol.empty()) {
+    stats.checkpoints++;
+    if (bookHash == expected) return;
+    stats.checkpointMismatches++;
+    _log("Book hash mismatch at checkpoint, sequence " + std::to_string(actionStamp.seq));
+    return;
+  }
+
+  auto it = symbolIds.find(symbol);
+  uint64_t hash = it == symbolIds.end() ? 0 : hotBooks[it->second].hash;
+  if (hash == expected) return;
+
+  stats.hashMismatches++;
+  _log("Book hash mismatch restoring " + symbol);
+}
+
+/*---------------------------------------------------------------------------------------------------------------------
+// Attempt to fill order in place. qty in out paramater, order, will be the remaining unfilled shares
+// TODO: The buy and ask branches are similar. Could potentially generalize with templates
+//---------------------------------------------------------------------------------------------------------------------*/
+template<typename Levels>
+void BasicSimpleCross<Levels>::_fillOrder(SymbolId symbolId, Order &order, std::vector<Fill> &fills) {
+  coldBooks[symbolId]->stats.crosses++;
+
+  if (order.side == Side::BUY) {
+    _fillBid(symbolId, order, fills);
+    _refreshBest(symbolId, Side::SELL);
+    _reclaimLevels(symbolId, Side::SELL);
+  } else if (order.side == Side::SELL) {
+    _fillAsk(symbolId, order, fills);
+    _refreshBest(symbolId, Side::BUY);
+    _reclaimLevels(symbolId, Side::BUY);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_fillBid(SymbolId symbolId, Order &order, std::vector<Fill> &fills) {
+  _log("Attempting to fill bid!");
+
+  BookHot<Levels>& hot = hotBooks[symbolId];
+  BookCold<Levels>& cold = *coldBooks[symbolId];
+  PriceLevels& askPxLevels = cold.asks;
+
+  // Start from the best level, anything below it is empty
+  for (auto pxLevelIt = hot.bestAskLevel; pxLevelIt != askPxLevels.end(); ++pxLevelIt) {
+    Price askPrice = pxLevelIt->first;
+    OrderQueue& askOrderQueue = pxLevelIt->second;
+    int ordersToPop = 0;
+
+    // Levels are sorted, so nothing past the first level that doesn't cross will either
+    if (order.px < askPrice) break;
+    if (askOrderQueue.empty()) continue;
+
+    for (OrderHandle handle = askOrderQueue.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+      Order& restingOrder = orderPool[handle].order;
+      Quantity sharesExecuted = std::min(restingOrder.qty, order.qty);
+      order.qty -= sharesExecuted;
+      _reduceOrder(askOrderQueue, handle, sharesExecuted);
+
+      if (sharesExecuted > 0) {
+        if (debug) {
+          _log("Crossed " + std::to_string(sharesExecuted) + " shared with order " + std::to_string(restingOrder.oid));
+        }
+      
+        Fill fill;
+        fill.oid = restingOrder.oid;
+        fill.symbol = restingOrder.symbol;
+        fill.qty = sharesExecuted;
+        fill.px = restingOrder.px;
+        fills.push_back(fill);
+        cold.stats.fills++;
+        cold.stats.filledQty += sharesExecuted;
+        _record(FlightEvent::FILL, static_cast<char>(Side::SELL), fill.oid, symbolId, fill.qty, fill.px);
+        _l3Change('E', fill.oid, fill.qty, fill.px);
+        _dropCopy(order, fill, fills.size());
+      }
+
+      if (restingOrder.qty == 0) ordersToPop++;
+      if (order.qty == 0) break;
+    }
+
+    // Clear resting orders with zero shares left, which are all at the front of the queue
+    for (int i=0; i < ordersToPop; i++) {
+      OrderHandle filled = askOrderQueue.head;
+      _record(FlightEvent::ORDER_PURGED, static_cast<char>(Side::SELL), orderPool[filled].order.oid, symbolId);
+      if (orderPool[filled].owner != 0) [[unlikely]] _forgetQuote(orderPool[filled]);
+      orderIndex.erase(orderPool[filled].order.oid);
+      _unlinkOrder(askOrderQueue, filled);
+      orderPool.release(filled);
+    }
+    hot.orders -= ordersToPop;
+
+    // Emptied levels stay allocated until reclaimed
+    if (askOrderQueue.empty()) {
+      _record(FlightEvent::LEVEL_EMPTIED, static_cast<char>(Side::SELL), order.oid, symbolId, 0, pxLevelIt->first);
+      hot.askLevels--;
+      cold.emptyAskLevels++;
+    }
+    if (order.qty == 0) break;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_fillAsk(SymbolId symbolId, Order &order, std::vector<Fill> &fills) {
+  _log("Attempting to fill ask!");
+
+  BookHot<Levels>& hot = hotBooks[symbolId];
+  BookCold<Levels>& cold = *coldBooks[symbolId];
+  PriceLevels& bidPxLevels = cold.bids;
+
+  // Iterate in reverse order because bidPxLevels.end() is most competitive price, starting from the best level
+  for (auto pxLevelIt = typename PriceLevels::reverse_iterator(std::next(hot.bestBidLevel));
+       pxLevelIt != bidPxLevels.rend(); ++pxLevelIt) {
+    Price bidPrice = pxLevelIt->first;
+    OrderQueue& bidOrderQueue = pxLevelIt->second;
+    int ordersToPop = 0;
+
+    // Levels are sorted, so nothing past the first level that doesn't cross will either
+    if (order.px > bidPrice) break;
+    if (bidOrderQueue.empty()) continue;
+
+    _log("Crossing order!");
+    for (OrderHandle handle = bidOrderQueue.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+      Order& restingOrder = orderPool[handle].order;
+      Quantity sharesExecuted = std::min(restingOrder.qty, order.qty);
+      order.qty -= sharesExecuted;
+      _reduceOrder(bidOrderQueue, handle, sharesExecuted);
+
+      if (sharesExecuted > 0) {
+        if (debug) _log("Crossed " + std::to_string(sharesExecuted) + " with order " + std::to_string(restingOrder.oid));
+      
+        Fill fill;
+        fill.oid = restingOrder.oid;
+        fill.symbol = restingOrder.symbol;
+        fill.qty = sharesExecuted;
+        fill.px = restingOrder.px;
+        fills.push_back(fill);
+        cold.stats.fills++;
+        cold.stats.filledQty += sharesExecuted;
+        _record(FlightEvent::FILL, static_cast<char>(Side::BUY), fill.oid, symbolId, fill.qty, fill.px);
+        _l3Change('E', fill.oid, fill.qty, fill.px);
+        _dropCopy(order, fill, fills.size());
+      }
+
+      if (restingOrder.qty == 0) ordersToPop++;
+      if (order.qty == 0) break;
+    }
+
+    // Clear resting orders with zero shares left, which are all at the front of the queue
+    for (int i=0; i < ordersToPop; i++) {
+      OrderHandle filled = bidOrderQueue.head;
+      _record(FlightEvent::ORDER_PURGED, static_cast<char>(Side::BUY), orderPool[filled].order.oid, symbolId);
+      if (orderPool[filled].owner != 0) [[unlikely]] _forgetQuote(orderPool[filled]);
+      orderIndex.erase(orderPool[filled].order.oid);
+      _unlinkOrder(bidOrderQueue, filled);
+      orderPool.release(filled);
+    }
+    hot.orders -= ordersToPop;
+
+    // Emptied levels stay allocated until reclaimed
+    if (bidOrderQueue.empty()) {
+      _record(FlightEvent::LEVEL_EMPTIED, static_cast<char>(Side::BUY), order.oid, symbolId, 0, pxLevelIt->first);
+      hot.bidLevels--;
+      cold.emptyBidLevels++;
+    }
+    if (order.qty == 0) break;
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::_validateOrderId(const OrderId orderId) {
+  return !orderIndex.seen(orderId);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_printFills(const std::vector<Fill> &fills, results_t *results) {
+  for (const Fill& fill : fills) {
+    EventRecord event = {};
+    event.type = 'F';
+    event.oid = fill.oid;
+    event.qty = fill.qty;
+    event.pxTicks = JournalFormat::toTicks(fill.px);
+    fill.symbol.copy(event.symbol, sizeof(event.symbol));
+
+    _emit(results, event, [&]() {
+      return "F "
+        + std::to_string(fill.oid) + " "
+        + fill.symbol + " "
+        + std::to_string(fill.qty) + " "
+        + std::to_string(fill.px);
+    });
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_printCancel(OrderId oid, results_t *results) {
+  EventRecord event = {};
+  event.type = 'X';
+  event.oid = oid;
+  _emit(results, event, [&]() { return "X " + std::to_string(oid); });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+bool BasicSimpleCross<Levels>::_printPosition(OrderId oid, results_t *results) {
+  OrderHandle handle = orderIndex.find(oid);
+  if (handle == NO_ORDER) return false;
+
+  RestingOrder& node = orderPool[handle];
+  auto [qtyAhead, ordersAhead] = orderPool.position(*node.queue, handle);
+  const Order& order = node.order;
+
+  EventRecord event = {};
+  event.type = 'Q';
+  event.oid = oid;
+  event.side = order.side;
+  event.qty = order.qty;
+  event.pxTicks = JournalFormat::toTicks(order.px);
+  order.symbol.copy(event.symbol, sizeof(event.symbol));
+
+  _emit(results, event, [&]() {
+    return "Q "
+      + std::to_string(oid) + " "
+      + order.symbol + " "
+      + static_cast<char>(order.side) + " "
+      + std::to_string(order.qty) + " "
+      + std::to_string(order.px) + " "
+      + std::to_string(ordersAhead) + " "
+      + std::to_string(qtyAhead);
+  });
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Hash of one symbol's book, or of every book when symbol is empty. Both are kept current, so this is a lookup
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_printHash(const Symbol &symbol, results_t *results) {
+  uint64_t hash = bookHash;
+  if (!symbol.empty()) {
+    auto it = symbolIds.find(symbol);
+    hash = it == symbolIds.end() ? 0 : hotBooks[it->second].hash;
+  }
+
+  EventRecord event = {};
+  event.type = 'H';
+  event.pxTicks = static_cast<int64_t>(hash);
+  symbol.copy(event.symbol, sizeof(event.symbol));
+
+  _emit(results, event, [&]() {
+    char text[32];
+    snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return "H " + (symbol.empty() ? std::string() : symbol + " ") + text;
+  });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_reject(RejectReason reason, Action action, OrderId oid, results_t *results) {
+  static const char* REJECT_TEXT[] = {
+    "", "Malformed action", "Invalid order side", "Invalid symbol", "Invalid quantity", "Invalid price",
+    "Duplicate order id", "Order ID not on book", "Unknown action"
+  };
+  static_assert(std::size(REJECT_TEXT) == static_cast<size_t>(RejectReason::COUNT));
+
+  stats.rejects[static_cast<size_t>(reason)]++;
+  _record(FlightEvent::REJECT, static_cast<char>(action), oid);
+
+  EventRecord event = {};
+  event.type = 'E';
+  event.oid = oid;
+  _emit(results, event, [&]() {
+    return "E " + std::to_string(oid) + " " + REJECT_TEXT[static_cast<size_t>(reason)];
+  });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Engine counters plus figures summed over the books. Nothing here is maintained for the query's sake, so its cost is
+// a walk over the symbols
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_printStats(results_t *results) {
+  static const char* REJECT_NAMES[] = {
+    "", "malformed", "bad_side", "bad_symbol", "bad_quantity", "bad_price", "duplicate_oid", "unknown_oid",
+    "unknown_action"
+  };
+  static_assert(std::size(REJECT_NAMES) == static_cast<size_t>(RejectReason::COUNT));
+
+  SymbolStats totals;
+  uint64_t liveBidLevels = 0, liveAskLevels = 0, emptyLevels = 0;
+  for (SymbolId symbolId = 0; symbolId < hotBooks.size(); symbolId++) {
+    const BookHot<Levels>& hot = hotBooks[symbolId];
+    const BookCold<Levels>& cold = *coldBooks[symbolId];
+    liveBidLevels += hot.bidLevels;
+    liveAskLevels += hot.askLevels;
+    emptyLevels += cold.emptyBidLevels + cold.emptyAskLevels;
+    totals.crosses += cold.stats.crosses;
+    totals.fills += cold.stats.fills;
+    totals.filledQty += cold.stats.filledQty;
+    totals.levelsCreated += cold.stats.levelsCreated;
+    totals.levelsReused += cold.stats.levelsReused;
+    totals.levelsReclaimed += cold.stats.levelsReclaimed;
+  }
+
+  auto ratio = [](uint64_t used, uint64_t available) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.5f", available ? static_cast<double>(used) / available : 0.0);
+    return std::string(text);
+  };
+
+  std::vector<std::pair<std::string, std::string>> counters = {
+    { "actions.place", std::to_string(stats.places) },
+    { "actions.cancel", std::to_string(stats.cancels) },
+    { "actions.print", std::to_string(stats.prints) },
+    { "actions.stats", std::to_string(stats.queries) },
+    { "actions.queue", std::to_string(stats.positions) },
+    { "actions.quote", std::to_string(stats.quotes) },
+    { "actions.bulk", std::to_string(stats.bulks) },
+    { "actions.hash", std::to_string(stats.hashes) },
+  };
+  for (size_t i = 1; i < std::size(REJECT_NAMES); i++) {
+    counters.emplace_back(std::string("rejects.") + REJECT_NAMES[i], std::to_string(stats.rejects[i]));
+  }
+  counters.insert(counters.end(), {
+    { "crosses", std::to_string(totals.crosses) },
+    { "fills", std::to_string(totals.fills) },
+    { "filled_qty", std::to_string(totals.filledQty) },
+    { "symbols", std::to_string(hotBooks.size()) },
+    { "orders.live", std::to_string(orderIndex.size()) },
+    { "levels.bid", std::to_string(liveBidLevels) },
+    { "levels.ask", std::to_string(liveAskLevels) },
+    { "levels.empty", std::to_string(emptyLevels) },
+    { "levels.created", std::to_string(totals.levelsCreated) },
+    { "levels.reused", std::to_string(totals.levelsReused) },
+    { "levels.reclaimed", std::to_string(totals.levelsReclaimed) },
+    { "index.pages", std::to_string(orderIndex.pages()) },
+    { "index.load", ratio(orderIndex.size(), orderIndex.capacity()) },
+    { "pool.live", std::to_string(orderPool.live()) },
+    { "pool.capacity", std::to_string(orderPool.capacity()) },
+    { "pool.utilization", ratio(orderPool.live(), orderPool.capacity()) },
+    { "recover.hash_mismatches", std::to_string(stats.hashMismatches) },
+    { "replica.checkpoints", std::to_string(stats.checkpoints) },
+    { "replica.checkpoint_mismatches", std::to_string(stats.checkpointMismatches) },
+    { "replica.lag_p50_ns", std::to_string(stats.lag.percentile(50)) },
+    { "replica.lag_p99_ns", std::to_string(stats.lag.percentile(99)) },
+    { "replica.lag_max_ns", std::to_string(stats.lag.maximum()) },
+    { "latency.count", std::to_string(stats.latency.count()) },
+    { "latency.p50_ns", std::to_string(stats.latency.percentile(50)) },
+    { "latency.p90_ns", std::to_string(stats.latency.percentile(90)) },
+    { "latency.p99_ns", std::to_string(stats.latency.percentile(99)) },
+    { "latency.p999_ns", std::to_string(stats.latency.percentile(99.9)) },
+    { "latency.max_ns", std::to_string(stats.latency.maximum()) },
+  });
+
+  EventRecord event = {};
+  event.type = 'S';
+  for (const auto& [name, value] : counters) _emit(results, event, [&]() { return "S " + name + " " + value; });
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stamp an outbound event and hand it to the binary event log, if enabled, and the text results, if wanted. format
+// builds the result line and only runs in the latter case, so binary callers never touch the heap here
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+template<typename Format>
+void BasicSimpleCross<Levels>::_emit(results_t *results, EventRecord event, Format format) {
+  Stamp stamp = _stamp();
+
+  if (eventLog) {
+    event.seq = stamp.seq;
+    event.ns = stamp.ns;
+    event.actionSeq = actionStamp.seq;
+    eventLog->write(reinterpret_cast<const char*>(&event), sizeof(event));
+  }
+
+  if (!results) return;
+  std::string line = format();
+  if (stampResults) {
+    line += " " + std::to_string(stamp.seq) + " " + std::to_string(stamp.ns)
+      + " " + std::to_string(actionStamp.seq) + " " + std::to_string(actionStamp.ns);
+  }
+  results->emplace_back(std::move(line));
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_printSortedBook(results_t *results) {
+  EventRecord event = {};
+  event.type = 'P';
+
+  if (hotBooks.empty()) {
+    _emit(results, event, []() { return std::string("Book empty!"); });
+    return;
+  }
+
+  for (SymbolId symbolId : _sortedSymbols()) {
+    const BookCold<Levels>& cold = *coldBooks[symbolId];
+    const Symbol& symbol = cold.symbol;
+    symbol.copy(event.symbol, sizeof(event.symbol));
+
+    Side side = Side::SELL;
+    for (auto pxLevelIt = cold.asks.rbegin(); pxLevelIt != cold.asks.rend(); ++pxLevelIt) {
+      Price price = pxLevelIt->first;
+      for (OrderHandle handle = pxLevelIt->second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+        const Order& order = orderPool[handle].order;
+        event.oid = order.oid;
+        event.side = side;
+        event.qty = order.qty;
+        event.pxTicks = JournalFormat::toTicks(price);
+        _emit(results, event, [&]() {
+          return "P "
+            + std::to_string(order.oid) + " "
+            + symbol + " "
+            + std::string(1, side) + " "
+            + std::to_string(order.qty) + " "
+            + std::to_string(price);
+        });
+      }
+    }
+
+    side = Side::BUY;
+    for (auto pxLevelIt = cold.bids.rbegin(); pxLevelIt != cold.bids.rend(); ++pxLevelIt) {
+      Price price = pxLevelIt->first;
+      for (OrderHandle handle = pxLevelIt->second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+        const Order& order = orderPool[handle].order;
+        event.oid = order.oid;
+        event.side = side;
+        event.qty = order.qty;
+        event.pxTicks = JournalFormat::toTicks(price);
+        _emit(results, event, [&]() {
+          return "P "
+            + std::to_string(order.oid) + " "
+            + symbol + " "
+            + std::string(1, side) + " "
+            + std::to_string(order.qty) + " "
+            + std::to_string(price);
+        });
+      }
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+const std::vector<std::string>& BasicSimpleCross<Levels>::_splitLine(const std::string &line, const char delim) {
+  // Split as std::getline would: empty fields between adjacent delimiters, none after a trailing one. Fields are
+  // assigned over the last line's, so once lineFields has grown a line of short fields allocates nothing
+  size_t count = 0;
+  for (size_t begin = 0; begin < line.size();) {
+    size_t end = std::min(line.find(delim, begin), line.size());
+    if (count == lineFields.size()) lineFields.emplace_back();
+    lineFields[count++].assign(line, begin, end - begin);
+    begin = end + 1;
+  }
+  lineFields.resize(count);
+  return lineFields;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+void BasicSimpleCross<Levels>::_logSortedBook() {
+  if (hotBooks.empty()) {
+    log("Book empty!");
+    return;
+  }
+
+  const std::string INDENT_1 = "|--";
+  const std::string INDENT_2 = "|   ";
+  const std::string INDENT_3 = "|    ";
+  const std::string INDENT_4 = "|     ";
+
+  log(" ________________________");
+  log("| Order Book");
+  for (SymbolId symbolId : _sortedSymbols()) {
+    const BookCold<Levels>& cold = *coldBooks[symbolId];
+    log(INDENT_1 + cold.symbol);
+
+    log(INDENT_2 + "Asks");
+    if (hotBooks[symbolId].askLevels == 0) log(INDENT_3 + "[EMPTY]");
+    for (auto pxLevelIt = cold.asks.rbegin(); pxLevelIt != cold.asks.rend(); ++pxLevelIt) {
+      if (pxLevelIt->second.empty()) continue;
+      log(INDENT_3 + "$" + std::to_string(pxLevelIt->first));
+      log(INDENT_4 + "OID\tQTY");
+      for (OrderHandle handle = pxLevelIt->second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+        const Order& order = orderPool[handle].order;
+        log(INDENT_4 + std::to_string(order.oid) + "\t" + std::to_string(order.qty));
+      }
+    }
+
+    log(INDENT_2 + "Bids");
+    if (hotBooks[symbolId].bidLevels == 0) log(INDENT_3 + "[EMPTY]");
+    for (auto pxLevelIt = cold.bids.rbegin(); pxLevelIt != cold.bids.rend(); ++pxLevelIt) {
+      if (pxLevelIt->second.empty()) continue;
       log(INDENT_3 + "$" + std::to_string(pxLevelIt->first));
       log(INDENT_4 + "OID  \tQTY");
-      for (Order order : pxLevelIt->second) {
+      for (OrderHandle handle = pxLevelIt->second.head; handle != NO_ORDER; handle = orderPool[handle].next) {
+        const Order& order = orderPool[handle].order;
         log(INDENT_4 + std::to_string(order.oid) + "\t" + std::to_string(order.qty));
       }
     }
   }
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Segments
+//
+// Independent matching segments (venues, asset classes, test symbols) hosted in one process. Each segment builds and
+// drives its own SimpleCross on its own thread, so its books live in that thread's NodeArena and its pool and index are
+// first touched there; segments share no allocator state and no cache lines. The router thread talks to a segment only
+// through a pair of single producer single consumer rings of text lines. Input lines are routed by a "SEGMENT:" prefix
+// (unprefixed lines go to the first segment) and each segment's results come back with its prefix. A segment given a
+// NUMA node pins its thread to that node's CPUs and binds its arena there before building the engine, so the books are
+// bound and everything else is placed by first touch. A segment can also name its price levels backend, which is how
+// a symbol class gets the book layout that suits it. The router's table is only a list of names read by one thread.
+//----------------------------------------------------------------------------------------------------------------------
+class Segment {
+public:
+  static constexpr size_t RING_LINES = 4096;
+
+  Segment(const std::string& name, int numaNode, LevelsKind levels, bool warmUp, size_t warmUpActions);
+  ~Segment() { if (thread.joinable()) thread.join(); }
+
+  const std::string& name() const { return segmentName; }
+
+  // Router side. send() and finish() never block on a full ring without draining results through `deliver`, so a
+  // segment waiting for room to return results can always make progress
+  template<typename Deliver> void send(std::string line, Deliver deliver);
+  void finish() { closed.store(true, std::memory_order_release); }
+  template<typename Deliver> bool drain(Deliver deliver);
+
+private:
+  void _run(bool warmUp, size_t warmUpActions);
+  template<typename Engine> void _serve(bool warmUp, size_t warmUpActions);
+
+private:
+  std::string segmentName;
+  int numaNode;
+  LevelsKind levelsKind;
+  SpscRing<std::string> inbound{RING_LINES};
+  SpscRing<std::string> outbound{RING_LINES};
+  std::atomic<bool> closed{false};
+  std::atomic<bool> finished{false};
+  std::thread thread;
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+Segment::Segment(const std::string& name, int _numaNode, LevelsKind levels, bool warmUp, size_t warmUpActions)
+  : segmentName(name)
+  , numaNode(_numaNode)
+  , levelsKind(levels)
+  , thread(&Segment::_run, this, warmUp, warmUpActions)
+{}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Deliver>
+void Segment::send(std::string line, Deliver deliver) {
+  while (!inbound.tryPush(line)) {
+    drain(deliver);
+    std::this_thread::yield();
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Hand every result waiting in the outbound ring to deliver. Returns false once the segment has finished and nothing
+// is left
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Deliver>
+bool Segment::drain(Deliver deliver) {
+  bool done = finished.load(std::memory_order_acquire);
+  std::string result;
+  while (outbound.tryPop(result)) deliver(*this, result);
+  return !done;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+void Segment::_run(bool warmUp, size_t warmUpActions) {
+  if (numaNode >= 0) {
+    if (!Numa::pinThread(numaNode)) std::cerr << segmentName << ": cannot pin to NUMA node " << numaNode << std::endl;
+    NodeArena::local().bindTo(numaNode);
+  }
+
+  switch (levelsKind) {
+    case LevelsKind::MAP: _serve<SimpleCross>(warmUp, warmUpActions); break;
+    case LevelsKind::FLAT: _serve<BasicSimpleCross<FlatLevels>>(warmUp, warmUpActions); break;
+    case LevelsKind::BTREE: _serve<BasicSimpleCross<BTreeLevels>>(warmUp, warmUpActions); break;
+    case LevelsKind::LADDER: _serve<BasicSimpleCross<LadderLevels<>>>(warmUp, warmUpActions); break;
+  }
+  finished.store(true, std::memory_order_release);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Engine>
+void Segment::_serve(bool warmUp, size_t warmUpActions) {
+  // Built on this thread so everything it allocates comes from this thread's arena and first touch
+  std::unique_ptr<Engine> engine = std::make_unique<Engine>();
+  if (warmUp) engine->warmUp(1 << 20, warmUpActions);
+
+  std::string line;
+  for (;;) {
+    if (!inbound.tryPop(line)) {
+      // The router closes after its last send, so a ring found empty after that stays empty
+      if (!closed.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+        continue;
+      }
+      if (!inbound.tryPop(line)) break;
+    }
+
+    results_t results = engine->action(line);
+    for (std::string& result : results) {
+      while (!outbound.tryPush(result)) std::this_thread::yield();
+    }
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Route the actions file across segments and print their results as "SEGMENT:RESULT". Results of one segment keep
+// their order; results of different segments interleave as they complete
+//----------------------------------------------------------------------------------------------------------------------
+int runSegments(const std::vector<std::string>& specs, std::istream& actions, bool warmUp, size_t warmUpActions) {
+  // NAME[@NODE][/LEVELS], the levels backend defaulting to map
+  std::vector<std::unique_ptr<Segment>> segments;
+  for (const std::string& spec : specs) {
+    size_t slash = spec.find('/');
+    LevelsKind levels = LevelsKind::MAP;
+    if (slash != std::string::npos && !parseLevelsKind(spec.substr(slash + 1), levels)) {
+      std::cerr << "Unknown price levels backend in segment " << spec << std::endl;
+      return 1;
+    }
+    std::string name = spec.substr(0, slash);
+    size_t at = name.find('@');
+    int numaNode = at == std::string::npos ? -1 : std::atoi(name.c_str() + at + 1);
+    segments.push_back(std::make_unique<Segment>(name.substr(0, at), numaNode, levels, warmUp, warmUpActions));
+  }
+
+  auto deliver = [](const Segment& segment, const std::string& result) {
+    std::cout << segment.name() << ':' << result << '\n';
+  };
+
+  std::string line;
+  while (std::getline(actions, line)) {
+    Segment* target = segments.front().get();
+    size_t colon = line.find(':');
+    if (colon != std::string::npos && colon < line.find(' ')) {
+      std::string prefix = line.substr(0, colon);
+      auto it = std::find_if(segments.begin(), segments.end(), [&](const std::unique_ptr<Segment>& segment) {
+        return segment->name() == prefix;
+      });
+      if (it == segments.end()) {
+        std::cout << prefix << ":E 0 Unknown segment" << '\n';
+        continue;
+      }
+      target = it->get();
+      line.erase(0, colon + 1);
+    }
+    target->send(std::move(line), deliver);
+  }
+
+  for (std::unique_ptr<Segment>& segment : segments) segment->finish();
+  bool running = true;
+  while (running) {
+    running = false;
+    for (std::unique_ptr<Segment>& segment : segments) running |= segment->drain(deliver);
+    if (running) std::this_thread::yield();
+  }
+  std::cout << std::flush;
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Benchmarks
+//----------------------------------------------------------------------------------------------------------------------
+typedef std::chrono::steady_clock bench_clock_t;
+
+double nsPer(bench_clock_t::time_point start, bench_clock_t::time_point end, size_t n) {
+  return std::chrono::duration<double, std::nano>(end - start).count() / std::max<size_t>(n, 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Encode cost on the write path and bytes saved versus the text form of the same actions
+//----------------------------------------------------------------------------------------------------------------------
+int benchJournal(size_t n) {
+  SyntheticFlow flow;
+  std::vector<ActionRecord> records;
+  records.reserve(n);
+  for (size_t i = 0; i < n; i++) records.push_back(flow.next());
+
+  size_t textBytes = 0;
+  auto start = bench_clock_t::now();
+  for (const ActionRecord& record : records) textBytes += SyntheticFlow::format(record).size() + 1;
+  double textNs = nsPer(start, bench_clock_t::now(), n);
+
+  std::ostringstream encoded;
+  start = bench_clock_t::now();
+  {
+    JournalWriter writer(encoded);
+    for (const ActionRecord& record : records) writer.append(record.action, record.order);
+  }
+  double encodeNs = nsPer(start, bench_clock_t::now(), n);
+  size_t journalBytes = encoded.str().size();
+
+  std::istringstream in(encoded.str());
+  JournalReader reader(in);
+  ActionRecord decoded;
+  size_t mismatches = 0, decodedCount = 0;
+  start = bench_clock_t::now();
+  while (reader.next(decoded)) {
+    const ActionRecord& expected = records[decodedCount++];
+    if (decoded.action != expected.action || decoded.order.oid != expected.order.oid
+        || (decoded.action == Action::PLACE && (decoded.order.symbol != expected.order.symbol
+          || decoded.order.side != expected.order.side || decoded.order.qty != expected.order.qty
+          || decoded.order.px != expected.order.px))) {
+      mismatches++;
+    }
+  }
+  double decodeNs = nsPer(start, bench_clock_t::now(), n);
+
+  printf("journal: %zu actions\n", n);
+  printf("  text     %10zu bytes  %6.2f bytes/action  %7.1f ns/action (format)\n",
+    textBytes, double(textBytes) / n, textNs);
+  printf("  journal  %10zu bytes  %6.2f bytes/action  %7.1f ns/action (encode)  %7.1f ns/action (decode)\n",
+    journalBytes, double(journalBytes) / n, encodeNs, decodeNs);
+  printf("  saved    %9.1f%%\n", 100.0 * (1.0 - double(journalBytes) / textBytes));
+
+  if (decodedCount != n || mismatches != 0 || reader.corrupt()) {
+    printf("  ROUND TRIP FAILED: decoded %zu, mismatches %zu\n", decodedCount, mismatches);
+    return 1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// Sequential versus symbol-partitioned recovery of the same journal. Both books are compared through their snapshots
+//----------------------------------------------------------------------------------------------------------------------
+int benchRecover(size_t n, unsigned threads) {
+  SyntheticFlow flow;
+  std::ostringstream encoded;
+  {
+    JournalWriter writer(encoded);
+    for (size_t i = 0; i < n; i++) {
+      ActionRecord record = flow.next();
+      writer.append(record.action, record.order);
+    }
+  }
+
+  std::string snapshots[2];
+  double seconds[2];
+  for (int parallel = 0; parallel < 2; parallel++) {
+    SimpleCross engine;
+    std::istringstream in(encoded.str());
+    auto start = bench_clock_t::now();
+    if (parallel) {
+      engine.recoverParallel(in, threads);
+    } else {
+      engine.recover(in);
+    }
+    seconds[parallel] = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+
+    std::ostringstream snapshot;
+    engine.writeSnapshot(snapshot);
+    snapshots[parallel] = snapshot.str();
+  }
+
+  printf("recover: %zu actions, %u threads\n", n, threads);
+  printf("  sequential %8.3f s\n", seconds[0]);
+  printf("  parallel   %8.3f s  (%.2fx)\n", seconds[1], seconds[0] / seconds[1]);
+
+  if (snapshots[0] != snapshots[1]) {
+    printf("  BOOKS DIFFER\n");
+    return 1;
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// Latency of the first actions a fresh engine sees, cold versus after warmUp(). Each run uses a new thread, and so a
+// new arena, so the cold run isn't helped by the warm one
+//----------------------------------------------------------------------------------------------------------------------
+int benchWarmUp(size_t n) {
+  const size_t BUCKET = 1000;
+
+  for (int warm = 0; warm < 2; warm++) {
+    std::vector<double> latencies;
+    std::thread([&]() {
+      SimpleCross engine;
+      if (warm) engine.warmUp();
+
+      // Different seed and OID range from the warm-up burst, so nothing is trivially reused
+      SyntheticFlow flow(500, 7, 1u << 30);
+      std::vector<std::string> lines;
+      for (size_t i = 0; i < n; i++) lines.push_back(SyntheticFlow::format(flow.next()));
+
+      latencies.reserve(n);
+      for (const std::string& line : lines) {
+        auto start = bench_clock_t::now();
+        engine.action(line);
+        latencies.push_back(nsPer(start, bench_clock_t::now(), 1));
+      }
+    }).join();
+
+    printf("warm-up: %s, first %zu actions (ns/action per %zu)\n", warm ? "warm" : "cold", n, BUCKET);
+    for (size_t b = 0; b < n; b += BUCKET) {
+      size_t end = std::min(n, b + BUCKET);
+      std::vector<double> bucket(latencies.begin() + b, latencies.begin() + end);
+      std::sort(bucket.begin(), bucket.end());
+      double mean = 0;
+      for (double latency : bucket) mean += latency;
+      printf("  %7zu  mean %8.1f  p50 %8.1f  p99 %8.1f\n",
+        b, mean / bucket.size(), bucket[bucket.size() / 2], bucket[bucket.size() * 99 / 100]);
+    }
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// OID index against std::map and hashing. Each step inserts the next OID, looks up a random live one and erases the
+// oldest once `window` orders are live
+//----------------------------------------------------------------------------------------------------------------------
+template <typename Insert, typename Find, typename Erase>
+double _benchIndexOps(const std::vector<OrderId>& oids, size_t window, Insert insert, Find find, Erase erase) {
+  std::mt19937_64 rng(11);
+  uint64_t checksum = 0;
+  auto start = bench_clock_t::now();
+  for (size_t i = 0; i < oids.size(); i++) {
+    insert(oids[i], static_cast<OrderHandle>(i));
+    size_t live = std::min(i + 1, window);
+    checksum += find(oids[i + 1 - live + rng() % live]);
+    if (i >= window) erase(oids[i - window]);
+  }
+  double ns = nsPer(start, bench_clock_t::now(), oids.size());
+  if (checksum == 0) printf("(checksum %lu)\n", checksum);
+  return ns;
+}
+
+int benchIndex(size_t n) {
+  const size_t WINDOW = 100000;
+  const size_t SESSIONS = 8;
+
+  std::vector<std::pair<const char*, std::vector<OrderId>>> patterns;
+  std::vector<OrderId> oids(n);
+  for (size_t i = 0; i < n; i++) oids[i] = static_cast<OrderId>(1000000 + i);
+  patterns.emplace_back("sequential", oids);
+
+  // Sessions interleave, each sequential within its own range
+  std::mt19937_64 rng(5);
+  std::vector<OrderId> nextInSession(SESSIONS);
+  for (size_t s = 0; s < SESSIONS; s++) nextInSession[s] = static_cast<OrderId>((s + 1) << 26);
+  for (size_t i = 0; i < n; i++) oids[i] = nextInSession[rng() % SESSIONS]++;
+  patterns.emplace_back("8 sessions", oids);
+
+  for (size_t i = 0; i < n; i++) oids[i] = static_cast<OrderId>(rng());
+  patterns.emplace_back("random", oids);
+
+  printf("index: %zu inserts, lookups and erases, %zu live (ns/step)\n", n, WINDOW);
+  printf("  %-12s %10s %10s %10s\n", "", "paged", "std::map", "unordered");
+  for (const auto& [name, pattern] : patterns) {
+    OrderIndex paged;
+    double pagedNs = _benchIndexOps(pattern, WINDOW,
+      [&](OrderId oid, OrderHandle handle) { paged.insert(oid, handle); },
+      [&](OrderId oid) { return paged.find(oid); },
+      [&](OrderId oid) { paged.erase(oid); });
+
+    std::map<OrderId, OrderHandle> tree;
+    double treeNs = _benchIndexOps(pattern, WINDOW,
+      [&](OrderId oid, OrderHandle handle) { tree.emplace(oid, handle); },
+      [&](OrderId oid) { auto it = tree.find(oid); return it != tree.end() ? it->second : NO_ORDER; },
+      [&](OrderId oid) { tree.erase(oid); });
+
+    std::unordered_map<OrderId, OrderHandle> hashed;
+    hashed.reserve(WINDOW * 2);
+    double hashedNs = _benchIndexOps(pattern, WINDOW,
+      [&](OrderId oid, OrderHandle handle) { hashed.emplace(oid, handle); },
+      [&](OrderId oid) { auto it = hashed.find(oid); return it != hashed.end() ? it->second : NO_ORDER; },
+      [&](OrderId oid) { hashed.erase(oid); });
+
+    printf("  %-12s %10.1f %10.1f %10.1f   (%zu pages)\n", name, pagedNs, treeNs, hashedNs, paged.pages());
+  }
+  return 0;
+}
+
+
+//----------------------------------------------------------------------------------------------------------------------
+// Place and cancel cost as the share of orders that cross shrinks: the symmetric synthetic flow, then passive flows
+// where most orders rest without crossing. Each flow runs against a fresh engine.
+//----------------------------------------------------------------------------------------------------------------------
+int benchPassive(size_t n) {
+  struct Mix { const char* name; bool passive; unsigned aggressivePercent; };
+  const Mix MIXES[] = { { "symmetric", false, 0 }, { "passive 10%", true, 10 }, { "passive 2%", true, 2 },
+                        { "passive 0%", true, 0 } };
+
+  printf("passive: %zu actions per flow\n", n);
+  printf("  flow          crosses   ns/action\n");
+  for (const Mix& mix : MIXES) {
+    SyntheticFlow flow;
+    if (mix.passive) flow.setPassive(mix.aggressivePercent);
+    std::vector<ActionRecord> records(n);
+    for (ActionRecord& record : records) record = flow.next();
+
+    // Best of three, each on a fresh engine
+    double best = 0;
+    std::string crosses;
+    for (int run = 0; run < 3; run++) {
+      std::vector<ActionRecord> replay = records;
+      SimpleCross engine;
+      bench_clock_t::time_point start = bench_clock_t::now();
+      for (ActionRecord& record : replay) engine.apply(record);
+      double ns = nsPer(start, bench_clock_t::now(), n);
+      best = run == 0 ? ns : std::min(best, ns);
+
+      for (const std::string& line : engine.action("S")) {
+        if (line.rfind("S crosses ", 0) == 0) crosses = line.substr(10);
+      }
+    }
+    printf("  %-12s %8s %11.1f\n", mix.name, crosses.c_str(), best);
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// One engine over the price levels backend Levels through a fresh copy of records, best of three
+//----------------------------------------------------------------------------------------------------------------------
+template<typename Levels>
+double benchLevelsRun(const std::vector<ActionRecord>& records) {
+  double best = 0;
+  for (int run = 0; run < 3; run++) {
+    std::vector<ActionRecord> replay = records;
+    BasicSimpleCross<Levels> engine;
+    bench_clock_t::time_point start = bench_clock_t::now();
+    for (ActionRecord& record : replay) engine.apply(record);
+    double ns = nsPer(start, bench_clock_t::now(), records.size());
+    best = run == 0 ? ns : std::min(best, ns);
+  }
+  return best;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Every price levels backend against the same flows: resting quotes only, quotes with sweeps through the book, and
+// the random walk, at several book depths. The depth is the number of price levels each side quotes across.
+//----------------------------------------------------------------------------------------------------------------------
+int benchLevels(size_t n) {
+  const size_t SYMBOLS = 50;
+  const unsigned DEPTHS[] = { 5, 50, 500 };
+  struct Shape { const char* name; bool passive; unsigned aggressivePercent; };
+  const Shape SHAPES[] = { { "quote", true, 0 }, { "sweep 10%", true, 10 }, { "walk", false, 0 } };
+
+  printf("levels: %zu actions per flow over %zu symbols, ns/action\n", n, SYMBOLS);
+  printf("  flow        depth");
+  for (const char* name : LEVELS_NAMES) printf(" %9s", name);
+  printf("\n");
+  for (const Shape& shape : SHAPES) {
+    for (unsigned depth : DEPTHS) {
+      // The walk sets its own depth
+      if (!shape.passive && depth != DEPTHS[0]) continue;
+
+      SyntheticFlow flow(SYMBOLS);
+      if (shape.passive) flow.setPassive(shape.aggressivePercent, depth);
+      std::vector<ActionRecord> records(n);
+      for (ActionRecord& record : records) record = flow.next();
+
+      printf("  %-10s %6s", shape.name, shape.passive ? std::to_string(depth).c_str() : "-");
+      printf(" %9.1f", benchLevelsRun<MapLevels>(records));
+      printf(" %9.1f", benchLevelsRun<FlatLevels>(records));
+      printf(" %9.1f", benchLevelsRun<BTreeLevels>(records));
+      printf(" %9.1f\n", benchLevelsRun<LadderLevels<>>(records));
+    }
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Cancel every order of a book much larger than the last level cache, in random order, one at a time and through
+// applyBatch. Each pass gets a freshly built book; the orders rest across 1000 symbols and 50 levels a side, so nearly
+// every cancel misses cache on its resting order and level.
+//----------------------------------------------------------------------------------------------------------------------
+int benchCancel(size_t n) {
+  const size_t SYMBOLS = 1000;
+  const int64_t LEVELS = 50;
+
+  std::vector<Symbol> symbols;
+  for (size_t i = 0; i < SYMBOLS; i++) symbols.push_back("C" + std::to_string(10000 + i));
+
+  std::vector<ActionRecord> cancels(n);
+  for (size_t i = 0; i < n; i++) {
+    cancels[i].action = Action::CANCEL;
+    cancels[i].order.oid = static_cast<OrderId>(i + 1);
+  }
+  std::shuffle(cancels.begin(), cancels.end(), std::mt19937_64(42));
+
+  printf("cancel: %zu resting orders cancelled in random order\n", n);
+  printf("  path          ns/cancel\n");
+  for (bool batched : { false, true }) {
+    SimpleCross engine;
+    std::mt19937_64 rng(7);
+    ActionRecord place;
+    place.action = Action::PLACE;
+    for (size_t i = 0; i < n; i++) {
+      bool buy = i % 2 == 0;
+      int64_t away = static_cast<int64_t>(1 + rng() % LEVELS) * 1000;
+      place.order.oid = static_cast<OrderId>(i + 1);
+      place.order.symbol = symbols[rng() % SYMBOLS];
+      place.order.side = buy ? Side::BUY : Side::SELL;
+      place.order.qty = 100;
+      place.order.px = JournalFormat::fromTicks(10000000 + (buy ? -away : away));
+      engine.apply(place);
+    }
+
+    std::vector<ActionRecord> replay = cancels;
+    bench_clock_t::time_point start = bench_clock_t::now();
+    if (batched) {
+      engine.applyBatch(replay.data(), replay.size());
+    } else {
+      for (ActionRecord& record : replay) engine.apply(record);
+    }
+    double ns = nsPer(start, bench_clock_t::now(), n);
+
+    std::string live;
+    for (const std::string& line : engine.action("S")) {
+      if (line.rfind("S orders.live ", 0) == 0) live = line.substr(14);
+    }
+    printf("  %-12s %10.1f%s\n", batched ? "batched" : "one by one", ns, live == "0" ? "" : "  (orders left!)");
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Two sided quote updates sent as mass quotes and as the cancels and places they stand for. Makers quote around a fixed
+// mid, so quotes never cross, and half the updates only change size at unchanged prices. Each maker keeps its OIDs
+// across mass quotes, while the cancel and place path needs fresh ones for every place, as O actions do.
+//----------------------------------------------------------------------------------------------------------------------
+int benchQuote(size_t n) {
+  const size_t SYMBOLS = 100;
+  const size_t MAKERS = 10; // per symbol
+  const int64_t MID = 10000000;
+
+  std::vector<Symbol> symbols;
+  for (size_t i = 0; i < SYMBOLS; i++) symbols.push_back("Q" + std::to_string(1000 + i));
+
+  std::mt19937_64 rng(42);
+  std::vector<int64_t> spreads(SYMBOLS * MAKERS, 1000);
+  std::vector<QuoteOrders> replaced(SYMBOLS * MAKERS);
+  OrderId nextOid = static_cast<OrderId>(2 * SYMBOLS * MAKERS + 1);
+  std::vector<ActionRecord> quotes(n), replaces;
+  replaces.reserve(4 * n);
+  for (ActionRecord& record : quotes) {
+    size_t maker = rng() % (SYMBOLS * MAKERS);
+    if (rng() % 2) spreads[maker] = static_cast<int64_t>(1 + rng() % 5) * 1000;
+    Quantity qty = static_cast<Quantity>(100 * (1 + rng() % 10));
+
+    record.action = Action::QUOTE;
+    record.order = Order(static_cast<OrderId>(2 * maker + 1), symbols[maker % SYMBOLS], Side::BUY, qty,
+                         JournalFormat::fromTicks(MID - spreads[maker]));
+    record.quote.pid = static_cast<uint32_t>(maker + 1);
+    record.quote.askOid = static_cast<OrderId>(2 * maker + 2);
+    record.quote.askQty = qty;
+    record.quote.askPx = JournalFormat::fromTicks(MID + spreads[maker]);
+
+    ActionRecord replace;
+    replace.action = Action::CANCEL;
+    replace.order.oid = replaced[maker].bid;
+    replaces.push_back(replace);
+    replace.order.oid = replaced[maker].ask;
+    replaces.push_back(replace);
+    replace.action = Action::PLACE;
+    replaced[maker] = QuoteOrders{ nextOid, nextOid + 1 };
+    nextOid += 2;
+    replace.order = Order(replaced[maker].bid, record.order.symbol, Side::BUY, qty, record.order.px);
+    replaces.push_back(replace);
+    replace.order = Order(replaced[maker].ask, record.order.symbol, Side::SELL, qty, record.quote.askPx);
+    replaces.push_back(replace);
+  }
+
+  printf("quote: %zu two sided updates over %zu symbols, %zu makers each\n", n, SYMBOLS, MAKERS);
+  printf("  path           ns/update\n");
+  for (bool massQuote : { true, false }) {
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+      std::vector<ActionRecord> replay = massQuote ? quotes : replaces;
+      SimpleCross engine;
+      bench_clock_t::time_point start = bench_clock_t::now();
+      for (ActionRecord& record : replay) engine.apply(record);
+      double ns = nsPer(start, bench_clock_t::now(), n);
+      best = run == 0 ? ns : std::min(best, ns);
+    }
+    printf("  %-13s %10.1f\n", massQuote ? "mass quote" : "cancel+place", best);
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// The places of a synthetic flow sent through action() as O lines and as baskets of B lines, counting the cost of
+// writing out each line's results as the driver does
+//----------------------------------------------------------------------------------------------------------------------
+int benchBulk(size_t n) {
+  const size_t BASKET = 20;
+
+  SyntheticFlow flow;
+  std::vector<std::string> singles, baskets;
+  std::string basket = "B";
+  while (singles.size() < n) {
+    ActionRecord record = flow.next();
+    if (record.action != Action::PLACE) continue;
+    std::string line = SyntheticFlow::format(record);
+    basket += line.substr(1);
+    singles.push_back(std::move(line));
+    if (singles.size() % BASKET == 0) {
+      baskets.push_back(basket);
+      basket = "B";
+    }
+  }
+  if (basket.size() > 1) baskets.push_back(basket);
+
+  printf("bulk: %zu places, %zu per basket\n", n, BASKET);
+  printf("  path        ns/order\n");
+  for (bool bulk : { false, true }) {
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+      SimpleCross engine;
+      std::ostringstream out;
+      bench_clock_t::time_point start = bench_clock_t::now();
+      for (const std::string& line : bulk ? baskets : singles) {
+        for (const std::string& result : engine.action(line)) out << result << '\n';
+        out.flush();
+      }
+      double ns = nsPer(start, bench_clock_t::now(), n);
+      best = run == 0 ? ns : std::min(best, ns);
+    }
+    printf("  %-10s %9.1f\n", bulk ? "B baskets" : "O lines", best);
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Duplicate order storm: O lines reusing the OIDs of resting orders, each rejected with an E result. Latency per action
+// through action(), counting the cost of writing out its result as the driver does
+//----------------------------------------------------------------------------------------------------------------------
+int benchReject(size_t n) {
+  const size_t RESTING = 1000;
+
+  SimpleCross engine;
+  for (size_t i = 0; i < RESTING; i++) engine.action("O " + std::to_string(i + 1) + " IBM B 10 100.00000");
+  std::vector<std::string> lines(n);
+  for (size_t i = 0; i < n; i++) lines[i] = "O " + std::to_string(i % RESTING + 1) + " IBM B 10 100.00000";
+
+  std::vector<double> latencies;
+  latencies.reserve(n);
+  size_t rejects = 0;
+  std::ostringstream out;
+  for (const std::string& line : lines) {
+    bench_clock_t::time_point start = bench_clock_t::now();
+    results_t results = engine.action(line);
+    for (const std::string& result : results) out << result << '\n';
+    out.flush();
+    latencies.push_back(nsPer(start, bench_clock_t::now(), 1));
+    if (results.size() == 1 && results.front()[0] == 'E') rejects++;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("reject: %zu duplicate places against %zu resting orders\n", n, RESTING);
+  printf("  p50 %8.1f ns  p99 %8.1f ns  max %10.1f ns\n", latencies[n / 2], latencies[n * 99 / 100], latencies.back());
+  if (rejects != n) {
+    printf("  %zu of %zu rejected\n", rejects, n);
+    return 1;
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Local versus remote memory for every (CPU node, memory node) pair: a dependent load chase through a buffer bound to
+// the memory node, and synthetic actions against an engine whose arena is bound there. Each pair runs on a fresh thread
+// pinned to the CPU node, and so with a fresh arena.
+//----------------------------------------------------------------------------------------------------------------------
+int benchNuma(size_t n) {
+  const size_t CHASE_BYTES = 256 << 20;
+  const size_t LINE_BYTES = 64;
+  int nodes = Numa::nodes();
+
+  std::vector<ActionRecord> records(n);
+  SyntheticFlow flow;
+  for (ActionRecord& record : records) record = flow.next();
+
+  printf("numa: %d node(s), %zu loads and %zu actions per pair\n", nodes, n, n);
+  printf("  cpu node  mem node   ns/load  ns/action\n");
+  for (int cpuNode = 0; cpuNode < nodes; cpuNode++) {
+    for (int memNode = 0; memNode < nodes; memNode++) {
+      double chaseNs = 0, engineNs = 0;
+      bool placed = true;
+      std::thread([&]() {
+        placed = Numa::pinThread(cpuNode);
+
+        char* buffer = static_cast<char*>(std::aligned_alloc(NodeArena::CHUNK_BYTES, CHASE_BYTES));
+        placed &= Numa::bind(buffer, CHASE_BYTES, memNode);
+
+        // One random cycle through every line, so each load depends on the last and misses cache
+        size_t lines = CHASE_BYTES / LINE_BYTES;
+        std::vector<size_t> order(lines);
+        for (size_t i = 0; i < lines; i++) order[i] = i;
+        std::shuffle(order.begin() + 1, order.end(), std::mt19937_64(7));
+        for (size_t i = 0; i < lines; i++) {
+          *reinterpret_cast<char**>(buffer + order[i] * LINE_BYTES) = buffer + order[(i + 1) % lines] * LINE_BYTES;
+        }
+        char* p = buffer;
+        bench_clock_t::time_point start = bench_clock_t::now();
+        for (size_t i = 0; i < n; i++) p = *reinterpret_cast<char**>(p);
+        chaseNs = nsPer(start, bench_clock_t::now(), n);
+        if (p == nullptr) printf("unreachable\n");
+        std::free(buffer);
+
+        NodeArena::local().bindTo(memNode);
+        SimpleCross engine;
+        std::vector<ActionRecord> replay = records;
+        start = bench_clock_t::now();
+        for (ActionRecord& record : replay) engine.apply(record);
+        engineNs = nsPer(start, bench_clock_t::now(), n);
+      }).join();
+
+      printf("  %8d  %8d  %8.1f  %9.1f%s\n", cpuNode, memNode, chaseNs, engineNs, placed ? "" : "  (placement failed)");
+    }
+  }
+  return 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Allocation Check
+//
+// Builds with -DSIMPLE_CROSS_COUNT_ALLOCS (make alloc-check) replace the global operator new with one that counts
+// calls on each thread. --alloc-check runs a few legs, each on a warmed-up engine, and fails unless none of them makes
+// heap allocations on the engine thread: synthetic places, crosses and cancels through SimpleCross::apply(), mass
+// quotes, B baskets through action(), and the first leg again feeding a drop copy. Arena chunks come from
+// aligned_alloc rather than operator new, so arena growth is checked separately.
+//----------------------------------------------------------------------------------------------------------------------
+#ifdef SIMPLE_CROSS_COUNT_ALLOCS
+thread_local uint64_t heapAllocations = 0;
+
+void* operator new(size_t bytes) {
+  heapAllocations++;
+  if (void* p = std::malloc(bytes ? bytes : 1)) return p;
+  throw std::bad_alloc();
+}
+
+// GCC can't see that these pair with the malloc above once it inlines them into new expressions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+int allocCheck([[maybe_unused]] size_t n) {
+#ifndef SIMPLE_CROSS_COUNT_ALLOCS
+  std::cerr << "--alloc-check needs a build with -DSIMPLE_CROSS_COUNT_ALLOCS (make alloc-check)" << std::endl;
+  return 1;
+#else
+  // Every leg's actions are generated up front, the generators' own bookkeeping allocates. Each leg runs n actions
+  // against a warmed-up engine after n warm-up actions of its own
+  printf("alloc-check: %zu actions per leg after %zu warm-up actions\n", n, n);
+  bool ok = true;
+  auto measure = [&](const char* leg, auto run) {
+    uint64_t allocations = heapAllocations;
+    size_t arenaBytes = NodeArena::local().reservedBytes();
+    run();
+    allocations = heapAllocations - allocations;
+    arenaBytes = NodeArena::local().reservedBytes() - arenaBytes;
+    printf("  %-11s heap allocations %llu, arena growth %zu bytes\n", leg,
+           static_cast<unsigned long long>(allocations), arenaBytes);
+    ok &= allocations == 0 && arenaBytes == 0;
+  };
+  auto flowRecords = [](SyntheticFlow& flow, size_t count) {
+    std::vector<ActionRecord> records(count);
+    for (ActionRecord& record : records) record = flow.next();
+    return records;
+  };
+
+  // Places, crosses and cancels through apply()
+  {
+    SyntheticFlow flow;
+    std::vector<ActionRecord> warm = flowRecords(flow, n), measured = flowRecords(flow, n);
+    SimpleCross engine;
+    engine.warmUp();
+    for (ActionRecord& record : warm) engine.apply(record);
+    measure("O/X", [&]() { for (ActionRecord& record : measured) engine.apply(record); });
+  }
+
+  // Mass quotes: makers requoting around a fixed mid under their own OIDs, in place or at new prices
+  {
+    const size_t SYMBOLS = 100, MAKERS = 10;
+    const int64_t MID = 10000000;
+    std::mt19937_64 rng(3);
+    std::vector<ActionRecord> quotes(2 * n);
+    for (ActionRecord& record : quotes) {
+      size_t maker = rng() % (SYMBOLS * MAKERS);
+      int64_t spread = static_cast<int64_t>(1 + rng() % 3) * 1000;
+      Quantity qty = static_cast<Quantity>(100 * (1 + rng() % 10));
+      record.action = Action::QUOTE;
+      record.order = Order(static_cast<OrderId>(2 * maker + 1), "Q" + std::to_string(1000 + maker % SYMBOLS),
+                           Side::BUY, qty, JournalFormat::fromTicks(MID - spread));
+      record.quote = QuoteFields{ static_cast<uint32_t>(maker + 1), static_cast<OrderId>(2 * maker + 2), qty,
+                                  JournalFormat::fromTicks(MID + spread) };
+    }
+    SimpleCross engine;
+    engine.warmUp();
+    for (size_t i = 0; i < n; i++) engine.apply(quotes[i]);
+    measure("M", [&]() { for (size_t i = n; i < 2 * n; i++) engine.apply(quotes[i]); });
+  }
+
+  // Baskets of resting orders through action(), the lines moved into its by-value argument. Crossing orders would
+  // add F result strings, which the text interface allocates by design
+  {
+    const size_t BASKET = 20;
+    SyntheticFlow flow;
+    flow.setPassive(0);
+    std::vector<std::string> baskets;
+    for (size_t places = 0; places < 2 * n;) {
+      std::string basket = "B";
+      for (size_t i = 0; i < BASKET; i++) {
+        ActionRecord record;
+        do record = flow.next(); while (record.action != Action::PLACE);
+        basket += SyntheticFlow::format(record).substr(1);
+      }
+      baskets.push_back(std::move(basket));
+      places += BASKET;
+    }
+    size_t half = baskets.size() / 2;
+    SimpleCross engine;
+    engine.warmUp();
+    for (size_t i = 0; i < half; i++) engine.action(std::move(baskets[i]));
+    measure("B", [&]() { for (size_t i = half; i < baskets.size(); i++) engine.action(std::move(baskets[i])); });
+  }
+
+  // The first leg again with a drop copy attached, its channel and a consumer on their own threads. The engine lets
+  // the channel catch up every so often, so a descheduled channel thread can't push executions into the overflow
+  {
+    SyntheticFlow flow;
+    std::vector<ActionRecord> warm = flowRecords(flow, n), measured = flowRecords(flow, n);
+    SimpleCross engine;
+    engine.warmUp();
+    DropCopy dropCopy;
+    engine.setDropCopy(&dropCopy);
+    size_t consumer = dropCopy.subscribe();
+    std::thread channel([&]() { dropCopy.run(); });
+    std::thread reader([&]() { runDropCopyConsumer(dropCopy, consumer, "/dev/null"); });
+    auto run = [&](std::vector<ActionRecord>& records) {
+      for (size_t i = 0; i < records.size(); i++) {
+        engine.apply(records[i]);
+        if (i % 1000 == 999) while (!dropCopy.drained()) std::this_thread::yield();
+      }
+    };
+    run(warm);
+    measure("drop copy", [&]() { run(measured); });
+    dropCopy.finish();
+    channel.join();
+    reader.join();
+  }
+
+  if (!ok) {
+    printf("  FAILED: the steady state matching path allocates\n");
+    return 1;
+  }
+  printf("  ok\n");
+  return 0;
+#endif
+}
 
 //----------------------------------------------------------------------------------------------------------------------
 // Main
 //----------------------------------------------------------------------------------------------------------------------
+// A command line count: all digits and in range
+bool parseCount(const char* text, size_t& count) {
+  const char* end = text + std::strlen(text);
+  auto [ptr, ec] = std::from_chars(text, end, count);
+  return ec == std::errc() && ptr == end && ptr != text;
+}
+
 int main(int argc, char **argv) {
+    // simple_cross [--journal FILE] [--snapshot FILE] [--recover FILE] [--recover-threads N]
+    //              [--warmup [N]] [--bench-journal [N]] [--bench-recover [N]] [--bench-warmup [N]]
+    //              [--bench-index [N]] [--stamps] [--events FILE] [--flight FILE] [--decode-flight FILE]
+    //              [--alloc-check [N]] [--segments NAME[@NODE][/LEVELS][,...]] [--bench-numa [N]]
+    //              [--bench-passive [N]] [--bench-levels [N]] [--bench-cancel [N]] [--bench-quote [N]]
+    //              [--bench-bulk [N]] [--bench-reject [N]] [--standby SOCKET]
+    //              [--replicate SOCKET [--checkpoint-every N]]
+    //              [--l3 FILE] [--decode-l3 FILE] [--l3-udp HOST:PORT --l3-retransmit HOST:PORT [--l3-udp-drop N]]
+    //              [--l3-subscribe HOST:PORT --l3-retransmit HOST:PORT] [--drop-copy FILE[,...]] [--image FILE]
+    //              [ACTIONS_FILE]
+    std::string actionsPath = "./tests/actions.txt";
+    std::string journalPath, snapshotPath, recoverPath, eventsPath, replicatePath, standbyPath, l3Path, imagePath;
+    std::string l3UdpAddr, l3RetransmitAddr, l3SubscribeAddr;
+    unsigned l3DropEvery = 0;
+    uint64_t checkpointEvery = SimpleCross::DEFAULT_CHECKPOINT_EVERY;
+    std::string flightPath = "./simple_cross.flight";
+    bool stamps = false;
+    std::vector<std::string> segmentNames, dropCopyPaths;
+    unsigned recoverThreads = std::thread::hardware_concurrency();
+    bool warmUp = false;
+    size_t warmUpActions = 100000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc && argv[i + 1][0] != '-';
+        // Counts are only taken from an argument that is one, so `--warmup ACTIONS_FILE` leaves the file alone
+        size_t count = 0;
+        bool hasCount = i + 1 < argc && parseCount(argv[i + 1], count);
+        auto countOr = [&](size_t fallback) { return hasCount ? (i++, count) : fallback; };
+        if (arg == "--journal" && hasValue) {
+            journalPath = argv[++i];
+        } else if (arg == "--snapshot" && hasValue) {
+            snapshotPath = argv[++i];
+        } else if (arg == "--segments" && hasValue) {
+            std::istringstream names(argv[++i]);
+            for (std::string name; std::getline(names, name, ',');) {
+                if (!name.empty()) segmentNames.push_back(name);
+            }
+        } else if (arg == "--drop-copy" && hasValue) {
+            std::istringstream paths(argv[++i]);
+            for (std::string path; std::getline(paths, path, ',');) {
+                if (!path.empty()) dropCopyPaths.push_back(path);
+            }
+        } else if (arg == "--stamps") {
+            stamps = true;
+        } else if (arg == "--events" && hasValue) {
+            eventsPath = argv[++i];
+        } else if (arg == "--flight" && hasValue) {
+            flightPath = argv[++i];
+        } else if (arg == "--decode-flight" && hasValue) {
+            return decodeFlightDump(argv[++i]);
+        } else if (arg == "--l3" && hasValue) {
+            l3Path = argv[++i];
+        } else if (arg == "--decode-l3" && hasValue) {
+            return decodeL3Feed(argv[++i]);
+        } else if (arg == "--l3-udp" && hasValue) {
+            l3UdpAddr = argv[++i];
+        } else if (arg == "--l3-retransmit" && hasValue) {
+            l3RetransmitAddr = argv[++i];
+        } else if (arg == "--l3-udp-drop" && hasCount) {
+            l3DropEvery = countOr(0);
+        } else if (arg == "--l3-subscribe" && hasValue) {
+            l3SubscribeAddr = argv[++i];
+        } else if (arg == "--recover" && hasValue) {
+            recoverPath = argv[++i];
+        } else if (arg == "--image" && hasValue) {
+            imagePath = argv[++i];
+        } else if (arg == "--replicate" && hasValue) {
+            replicatePath = argv[++i];
+        } else if (arg == "--checkpoint-every" && hasCount) {
+            checkpointEvery = countOr(0);
+        } else if (arg == "--standby" && hasValue) {
+            standbyPath = argv[++i];
+        } else if (arg == "--recover-threads" && hasCount) {
+            recoverThreads = countOr(0);
+        } else if (arg == "--warmup") {
+            warmUp = true;
+            warmUpActions = countOr(warmUpActions);
+        } else if (arg == "--alloc-check") {
+            return allocCheck(countOr(200000));
+        } else if (arg == "--bench-passive") {
+            return benchPassive(countOr(1000000));
+        } else if (arg == "--bench-levels") {
+            return benchLevels(countOr(500000));
+        } else if (arg == "--bench-cancel") {
+            return benchCancel(countOr(4000000));
+        } else if (arg == "--bench-quote") {
+            return benchQuote(countOr(2000000));
+        } else if (arg == "--bench-reject") {
+            return benchReject(std::max<size_t>(countOr(500000), 1));
+        } else if (arg == "--bench-bulk") {
+            return benchBulk(countOr(1000000));
+        } else if (arg == "--bench-numa") {
+            return benchNuma(countOr(200000));
+        } else if (arg == "--bench-index") {
+            return benchIndex(countOr(5000000));
+        } else if (arg == "--bench-warmup") {
+            return benchWarmUp(countOr(5000));
+        } else if (arg == "--bench-recover") {
+            return benchRecover(countOr(1000000), std::max(recoverThreads, 2u));
+        } else if (arg == "--bench-journal") {
+            return benchJournal(countOr(1000000));
+        } else if (arg[0] != '-') {
+            actionsPath = arg;
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (!l3SubscribeAddr.empty()) return subscribeL3(l3SubscribeAddr, l3RetransmitAddr);
+
+    // Segments are self contained engines, persistence and output options apply to the single engine mode
+    if (!segmentNames.empty()) {
+        std::ifstream actions(actionsPath, std::ios::in);
+        return runSegments(segmentNames, actions, warmUp, warmUpActions);
+    }
+
     SimpleCross scross;
+    FlightRecorder::installDumpHandler(&scross.flightRecorder(), flightPath);
+    if (warmUp) scross.warmUp(1 << 20, warmUpActions);
+
+    // Attached before recovery, so the feed opens with the recovered books. The file and UDP publisher are
+    // independent consumers of the one feed
+    bool l3 = !l3Path.empty() || !l3UdpAddr.empty();
+    L3Feed l3Feed(l3 ? L3Feed::DEFAULT_EVENTS : 1);
+    L3Publisher l3Publisher(l3Feed, l3DropEvery);
+    L3Consumers l3Consumers;
+    if (!l3UdpAddr.empty() && !l3Publisher.open(l3UdpAddr, l3RetransmitAddr)) {
+        std::cerr << "Cannot publish the L3 feed to " << l3UdpAddr << " with retransmits on " << l3RetransmitAddr
+                  << std::endl;
+        return 1;
+    }
+    if (l3) scross.setL3Feed(&l3Feed);
+    if (!l3Path.empty()) l3Consumers.start([&]() { writeL3Feed(l3Feed, l3Path, l3Consumers.done()); });
+    if (!l3UdpAddr.empty()) {
+        l3Consumers.start([&]() { l3Publisher.run(l3Consumers.done()); });
+        l3Consumers.start([&]() { l3Publisher.serveRetransmits(); });
+    }
+
+    // An image that has committed actions already holds the books up to its last one, so only the journal after that
+    // is replayed. An empty one is filled with whatever recovery rebuilt
+    BookImage image;
+    bool imageRestored = false;
+    if (!imagePath.empty()) {
+        if (!image.open(imagePath)) {
+            std::cerr << "Cannot open book image " << imagePath << std::endl;
+            return 1;
+        }
+        if (!image.empty()) {
+            if (!scross.attachImage(image)) {
+                std::cerr << "Book image " << imagePath << " is inconsistent" << std::endl;
+                return 1;
+            }
+            imageRestored = true;
+            std::cerr << "Attached book image " << imagePath << " at sequence " << image.actionSeq() << ", "
+                      << image.rolledBack() << " torn writes rolled back" << std::endl;
+        }
+    }
+
+    if (!recoverPath.empty()) {
+        std::ifstream recoverFile(recoverPath, std::ios::in | std::ios::binary);
+        if (imageRestored) {
+            scross.recover(recoverFile, image.actionSeq());
+        } else {
+            scross.recoverParallel(recoverFile, recoverThreads);
+        }
+    }
+    if (!imagePath.empty() && !imageRestored && !scross.attachImage(image)) {
+        std::cerr << "Cannot fill book image " << imagePath << std::endl;
+        return 1;
+    }
+
+    // A standby applies its primary's stream until the primary goes away, then takes over on ACTIONS_FILE
+    if (!standbyPath.empty()) {
+        int fd = LocalSocket::acceptOne(standbyPath);
+        if (fd < 0) {
+            std::cerr << "Cannot listen on " << standbyPath << std::endl;
+            return 1;
+        }
+        FdStreamBuf standbyBuf(fd);
+        std::istream standbyStream(&standbyBuf);
+        size_t applied = scross.follow(standbyStream);
+
+        const EngineStats& stats = scross.engineStats();
+        std::cerr << "Standby taking over at sequence " << scross.lastSequence() << ": " << applied << " records, "
+                  << stats.checkpoints << " checkpoints, " << stats.checkpointMismatches << " mismatched, lag p50 "
+                  << stats.lag.percentile(50) << "ns p99 " << stats.lag.percentile(99) << "ns" << std::endl;
+    }
+
+    std::ofstream journalFile;
+    std::unique_ptr<JournalWriter> journal;
+    if (!journalPath.empty()) {
+        journalFile.open(journalPath, std::ios::out | std::ios::binary | std::ios::app);
+        journal = std::make_unique<JournalWriter>(journalFile, JournalBlock::ACTIONS, true);
+        scross.setJournal(journal.get());
+    }
+
+    std::unique_ptr<ReplicaSender> replicaBuf;
+    std::unique_ptr<std::ostream> replicaStream;
+    std::unique_ptr<JournalWriter> replica;
+    if (!replicatePath.empty()) {
+        int fd = LocalSocket::connect(replicatePath);
+        if (fd < 0) {
+            std::cerr << "Cannot connect to standby at " << replicatePath << std::endl;
+            return 1;
+        }
+        replicaBuf = std::make_unique<ReplicaSender>(fd);
+        replicaStream = std::make_unique<std::ostream>(replicaBuf.get());
+        // One record per block, sent as soon as it is journaled
+        replica = std::make_unique<JournalWriter>(*replicaStream, JournalBlock::ACTIONS, true, 1);
+        scross.setReplica(replica.get(), checkpointEvery);
+    }
+
+    // One channel thread, then a thread per consumer reading at its own pace
+    DropCopy dropCopy;
+    std::vector<std::thread> dropCopyThreads;
+    if (!dropCopyPaths.empty()) {
+        scross.setDropCopy(&dropCopy);
+        dropCopyThreads.emplace_back([&]() { dropCopy.run(); });
+        for (const std::string& path : dropCopyPaths) {
+            size_t consumer = dropCopy.subscribe();
+            dropCopyThreads.emplace_back([&dropCopy, consumer, path]() {
+                runDropCopyConsumer(dropCopy, consumer, path);
+            });
+        }
+    }
+
+    std::ofstream eventsFile;
+    if (!eventsPath.empty()) {
+        eventsFile.open(eventsPath, std::ios::out | std::ios::binary | std::ios::app);
+        scross.setEventLog(&eventsFile);
+    }
+    scross.setStampedResults(stamps);
+
     std::string line;
-    std::ifstream actions("./tests/actions.txt", std::ios::in);
+    std::ifstream actions(actionsPath, std::ios::in);
     while (std::getline(actions, line)) {
+        // One flush per action, however many results it has
         results_t results = scross.action(line);
         for (results_t::const_iterator it=results.begin(); it!=results.end(); ++it) {
-            std::cout << *it << std::endl;
+            std::cout << *it << '\n';
         }
+        if (!results.empty()) std::cout << std::flush;
+    }
+
+    if (journal) journal->flush();
+    if (!imagePath.empty()) image.flush();
+    l3Consumers.finish();
+    if (!dropCopyThreads.empty()) {
+        dropCopy.finish();
+        for (std::thread& thread : dropCopyThreads) thread.join();
+    }
+    if (replicaBuf && !replicaBuf->finish()) std::cerr << "Lost the standby at " << replicatePath << std::endl;
+    if (!snapshotPath.empty()) {
+        std::ofstream snapshotFile(snapshotPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        scross.writeSnapshot(snapshotFile);
     }
     return 0;
 }